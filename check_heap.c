@@ -1,8 +1,266 @@
-
 #include "umalloc.h"
+#include "csbrk.h"
+#include <string.h>
+
+// The incremental check reads the logs that only an allocator built with
+// UMALLOC_CHECK keeps, and arena_t must be laid out the same on both sides.
+#ifndef UMALLOC_CHECK
+#error "check_heap.c must be built with UMALLOC_CHECK, like the allocator it checks"
+#endif
 
 //Place any variables needed here from umalloc.c as an extern.
-extern memory_block_t *free_head;
+extern arena_t arenas[NUM_ARENAS];
+
+// The blocks the last sweep of the whole heap looked at, and the incremental
+// checks since then.
+static size_t swept_blocks;
+static size_t checks_since_sweep;
+
+/*
+ * check_free_block - checks the parts of a free block that do not depend on
+ * where it is kept.
+ */
+static int check_free_block(memory_block_t *cur) {
+    // checking that only free blocks are in the bins
+    if (is_allocated(cur)) {
+        return -1;
+    }
+
+    // checking if the blocks misalign
+    if ((get_size(cur) + HEADER_SIZE) % ALIGNMENT != 0 || (size_t)get_payload(cur) % ALIGNMENT != 0) {
+        return -1;
+    }
+
+    // checking that the footer matches the header
+    memory_block_t *after = get_next_adjacent(cur);
+    if (*((size_t *)after - 1) != get_size(cur)) {
+        return -1;
+    }
+
+    // checking that the block after knows this block is free
+    if (is_prev_allocated(after)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * check_tree - checks the subtree at node is ordered by size, balanced, and
+ * that every block hanging off a node has the node's size. Returns the height
+ * of the subtree, or -1 if it is not consistent.
+ */
+static int check_tree(tree_node_t *node, size_t low, size_t high) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    size_t size = get_size(&node->block);
+    if (size < low || size > high || size < TREE_THRESHOLD || get_prev(&node->block) != NULL) {
+        return -1;
+    }
+
+    for (memory_block_t *cur = &node->block; cur; cur = get_next(cur)) {
+        if (check_free_block(cur) || get_size(cur) != size) {
+            return -1;
+        }
+        if (get_next(cur) && get_prev(get_next(cur)) != cur) {
+            return -1;
+        }
+    }
+
+    int left = check_tree(node->left, low, size - ALIGNMENT);
+    int right = check_tree(node->right, size + ALIGNMENT, high);
+    if (left == -1 || right == -1 || left > right + 1 || right > left + 1) {
+        return -1;
+    }
+
+    int height = (left > right ? left : right) + 1;
+    return node->height == height ? height : -1;
+}
+
+/*
+ * check_slab - checks a slab is intact and that its free slots and counts
+ * stay inside its page.
+ */
+static int check_slab(slab_t *slab, size_t slot_size) {
+    if (get_slab((char *)slab + SLAB_HEADER_SIZE) != slab || slab->slot_size != slot_size) {
+        return -1;
+    }
+
+    char *first = (char *)slab + SLAB_HEADER_SIZE;
+    char *end = (char *)slab + PAGESIZE;
+    if (slab->unused < first || slab->unused > end || (slab->unused - first) % slot_size != 0) {
+        return -1;
+    }
+
+    // checking that free slots are not marked in use
+    size_t free_count = 0;
+    for (char *slot = slab->free_slots; slot; slot = *(char **)slot) {
+        if (slot < first || slot >= slab->unused || (slot - first) % slot_size != 0 || slot_in_use(slab, slot)) {
+            return -1;
+        }
+        free_count++;
+    }
+
+    // checking that the slots marked in use are as many as the slab counts
+    size_t in_use = 0;
+    for (char *slot = first; slot < slab->unused; slot += slot_size) {
+        in_use += slot_in_use(slab, slot);
+    }
+
+    return slab->used + free_count == (slab->unused - first) / slot_size && in_use == slab->used ? 0 : -1;
+}
+
+/*
+ * has_quick_mark - returns true if the second word of a block's payload holds
+ * the free mark quick_push leaves in it.
+ */
+static bool has_quick_mark(memory_block_t *cur) {
+    uintptr_t *payload = get_payload(cur);
+    return payload[1] == ((uintptr_t)payload ^ FREE_MAGIC);
+}
+
+/*
+ * check_block - checks a block between the prologue and epilogue of a region
+ * is aligned and ends by the epilogue, that the block after it knows whether
+ * it is allocated, that a free block before it ends where it starts, and
+ * that a free block is not right after another one.
+ */
+static int check_block(region_t *region, memory_block_t *cur) {
+    memory_block_t *prologue = (memory_block_t *)(region + 1);
+    if (cur <= prologue || cur >= region->epilogue || is_mmapped(cur)) {
+        return -1;
+    }
+
+    if ((get_size(cur) + HEADER_SIZE) % ALIGNMENT != 0 || (size_t)get_payload(cur) % ALIGNMENT != 0) {
+        return -1;
+    }
+
+    memory_block_t *after = get_next_adjacent(cur);
+    if (after > region->epilogue || is_prev_allocated(after) != is_allocated(cur)) {
+        return -1;
+    }
+
+    // checking the footer before the block leads back to a free block of that size
+    if (!is_prev_allocated(cur)) {
+        size_t prev_size = *((size_t *)cur - 1);
+        memory_block_t *before = (memory_block_t *)((char *)cur - prev_size - HEADER_SIZE);
+        if (before <= prologue || is_allocated(before) || get_size(before) != prev_size) {
+            return -1;
+        }
+    }
+
+    if (!is_allocated(cur) && (!is_prev_allocated(cur) || check_free_block(cur))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * check_regions - checks every region of an arena starts with its prologue
+ * and ends with its epilogue, and that the page map leads to it. The blocks
+ * in between are left to check_block.
+ */
+static int check_regions(arena_t *arena) {
+    for (region_t *region = arena->regions; region; region = region->next) {
+        memory_block_t *prologue = (memory_block_t *)(region + 1);
+        if (!is_allocated(prologue) || get_size(prologue) != 0) {
+            return -1;
+        }
+
+        // checking that the page map leads to the region from both of its ends
+        if (region->arena != arena || get_region(prologue) != region || get_region(region->epilogue) != region) {
+            return -1;
+        }
+
+        if (!is_allocated(region->epilogue) || get_size(region->epilogue) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * check_arena - checks the free structures and slabs of one arena.
+ */
+static int check_arena(arena_t *arena) {
+    if (check_regions(arena)) {
+        return -1;
+    }
+
+    for (int bin = 0; bin < NUM_BINS; bin++) {
+        memory_block_t *cur = arena->free_bins[bin];
+
+        // checking that the bitmaps mark exactly the non-empty bins
+        bool marked = (arena->bin_map[bin / 64] >> (bin % 64)) & 1;
+        if (marked != (cur != NULL) || (marked && !((arena->bin_summary >> (bin / 64)) & 1))) {
+            return -1;
+        }
+
+        while (cur) {
+
+            if (check_free_block(cur)) {
+                return -1;
+            }
+
+            // checking that the block is in the bin for its size
+            if (get_size(cur) >= TREE_THRESHOLD || get_bin(get_size(cur)) != bin) {
+                return -1;
+            }
+
+            // checking that the list links agree in both directions
+            if (get_prev(cur) == NULL ? arena->free_bins[bin] != cur : get_next(get_prev(cur)) != cur) {
+                return -1;
+            }
+
+            cur = get_next(cur);
+        }
+    }
+
+    if (check_tree(arena->tree_root, 0, (size_t)-1) == -1) {
+        return -1;
+    }
+
+    // checking that the quick lists hold marked allocated heap blocks of their
+    // size, and no more of them than quick_bytes counts, so a list that loops
+    // back on itself ends the walk
+    size_t quick_bytes = 0;
+    for (int list = 0; list < QUICK_LISTS; list++) {
+        for (memory_block_t *cur = arena->quick_lists[list]; cur; cur = *(memory_block_t **)get_payload(cur)) {
+            if (!is_allocated(cur) || is_mmapped(cur) || (get_size(cur) + HEADER_SIZE) / ALIGNMENT - 1 != list ||
+                !is_prev_allocated(get_next_adjacent(cur)) || !has_quick_mark(cur)) {
+                return -1;
+            }
+            quick_bytes += get_size(cur);
+            if (quick_bytes > arena->quick_bytes) {
+                return -1;
+            }
+        }
+    }
+    if (quick_bytes != arena->quick_bytes) {
+        return -1;
+    }
+
+    // checking that the slabs with free slots are not full or empty
+    for (int slab_class = 0; slab_class < SLAB_CLASSES; slab_class++) {
+        for (slab_t *slab = arena->slab_partial[slab_class]; slab; slab = slab->next) {
+            if (check_slab(slab, (slab_class + 1) * ALIGNMENT) || slab->arena != arena || slab->used == 0 ||
+                (slab->free_slots == NULL && slab->unused + slab->slot_size > (char *)slab + PAGESIZE)) {
+                return -1;
+            }
+        }
+    }
+    for (slab_t *slab = arena->slab_empty; slab; slab = slab->next) {
+        if (slab->used != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
 
 /*
  * check_heap -  used to check that the heap is still in a consistent state.
@@ -23,27 +281,187 @@ extern memory_block_t *free_head;
  * return code. Asserts are also a useful tool here.
  */
 int check_heap() {
-    memory_block_t *cur = free_head;
-    while (cur) {
-        
-        // checking if the list is in order by address
-        if (get_next(cur) && cur > get_next(cur)) {
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        if (check_arena(&arenas[i]) == -1) {
             return -1;
         }
+    }
 
-        // checking if any blocks are overlapping
-        if (get_next(cur) && cur + (get_size(cur) / ALIGNMENT) > get_next(cur)) {
+    // checking that the blocks fill each region from its prologue to its epilogue
+    heap_walk_t walk;
+    size_t blocks = 0;
+    heap_walk_start(&walk);
+    for (memory_block_t *cur = heap_walk_next(&walk); cur; cur = heap_walk_next(&walk)) {
+        if (check_block(walk.region, cur)) {
             return -1;
         }
+        blocks++;
+    }
+
+    // every change logged so far was just checked
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        arenas[i].dirty_count = 0;
+        arenas[i].dirty_slab_count = 0;
+    }
+    swept_blocks = blocks;
+    checks_since_sweep = 0;
+    return 0;
+}
+
+/*
+ * check_free_links - checks a free block is linked into the free structure
+ * for its size, looking only at its neighbors in the list and, for the first
+ * block of a list, at where the list starts.
+ */
+static int check_free_links(arena_t *arena, memory_block_t *cur) {
+    memory_block_t *next = get_next(cur);
+    if (next && (is_allocated(next) || get_prev(next) != cur)) {
+        return -1;
+    }
+
+    memory_block_t *prev = get_prev(cur);
+    if (prev) {
+        return !is_allocated(prev) && get_next(prev) == cur ? 0 : -1;
+    }
+
+    size_t size = get_size(cur);
+    if (size >= TREE_THRESHOLD) {
+        // the first block of a size is its node in the size tree
+        tree_node_t *node = arena->tree_root;
+        while (node && get_size(&node->block) != size) {
+            node = size < get_size(&node->block) ? node->left : node->right;
+        }
+        return node == (tree_node_t *)cur ? 0 : -1;
+    }
+
+    int bin = get_bin(size);
+    bool marked = (arena->bin_map[bin / 64] >> (bin % 64)) & 1;
+    return arena->free_bins[bin] == cur && marked ? 0 : -1;
+}
 
-        // checking if the blocks misalign
-        if (get_size(cur) % ALIGNMENT != 0) {
+/*
+ * check_quick - checks a marked allocated block that was logged is on the
+ * quick list for its size at most once. An unmarked block is on no list,
+ * which every sweep makes sure of. The walk stops after as many blocks as
+ * quick_bytes allows, so a list that loops back fails rather than hangs.
+ */
+static int check_quick(arena_t *arena, memory_block_t *cur) {
+    size_t size = get_size(cur);
+    if (size > QUICK_MAX_SIZE) {
+        return 0;
+    }
+
+    size_t limit = arena->quick_bytes / size;
+    size_t found = 0;
+    memory_block_t *block = arena->quick_lists[(size + HEADER_SIZE) / ALIGNMENT - 1];
+    for (size_t steps = 0; block; steps++) {
+        if (steps == limit) {
             return -1;
         }
+        found += block == cur;
+        block = *(memory_block_t **)get_payload(block);
+    }
+    return found <= 1 ? 0 : -1;
+}
+
+/*
+ * compare_address - orders logged blocks or slabs by address for qsort.
+ */
+static int compare_address(const void *a, const void *b) {
+    uintptr_t first = (uintptr_t)*(void *const *)a;
+    uintptr_t second = (uintptr_t)*(void *const *)b;
+    return (first > second) - (first < second);
+}
+
+/*
+ * check_dirty - checks the blocks in an arena's change log. Logged blocks
+ * that were since merged into a block before them, or trimmed off with the
+ * top of the heap, are skipped: the block that took their place was logged
+ * when its header was written, and sorting the log checks it first.
+ */
+static int check_dirty(arena_t *arena) {
+    memory_block_t *dirty[DIRTY_LOG_SIZE];
+    size_t count = arena->dirty_count;
+    memcpy(dirty, arena->dirty_blocks, count * sizeof(*dirty));
+    qsort(dirty, count, sizeof(*dirty), compare_address);
+
+    memory_block_t *checked = NULL;
+    for (size_t i = 0; i < count; i++) {
+        memory_block_t *cur = dirty[i];
+        region_t *region = get_region(cur);
+        memory_block_t *prologue = region ? (memory_block_t *)(region + 1) : NULL;
+        if (region == NULL || cur < checked || cur < prologue) {
+            continue;
+        }
+
+        if (cur == prologue || cur == region->epilogue) {
+            if (!is_allocated(cur) || get_size(cur) != 0) {
+                return -1;
+            }
+            checked = get_next_adjacent(cur);
+            continue;
+        }
 
-        cur = get_next(cur);
+        if (check_block(region, cur) || (!is_allocated(cur) && check_free_links(region->arena, cur)) ||
+            (is_allocated(cur) && has_quick_mark(cur) && check_quick(region->arena, cur))) {
+            return -1;
+        }
+        checked = get_next_adjacent(cur);
     }
 
+    return 0;
+}
+
+/*
+ * check_dirty_slabs - checks the slabs in an arena's change log, each once.
+ */
+static int check_dirty_slabs(arena_t *arena) {
+    slab_t *dirty[DIRTY_LOG_SIZE];
+    size_t count = arena->dirty_slab_count;
+    memcpy(dirty, arena->dirty_slabs, count * sizeof(*dirty));
+    qsort(dirty, count, sizeof(*dirty), compare_address);
+
+    for (size_t i = 0; i < count; i++) {
+        slab_t *slab = dirty[i];
+        if (i > 0 && slab == dirty[i - 1]) {
+            continue;
+        }
+        if (slab->arena != arena || slab->slot_size == 0 || slab->slot_size > SLAB_MAX_SIZE ||
+            slab->slot_size % ALIGNMENT != 0 || check_slab(slab, slab->slot_size)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * check_heap_incremental - checks the blocks and slabs changed since the heap
+ * was last checked, along with the blocks next to them, the quick lists the
+ * blocks may be on and every slot of the slabs, which takes O(1) per call. It
+ * falls back to check_heap when a change log overflowed, and once it was
+ * called as many times as the last sweep of the whole heap looked at blocks,
+ * so the sweeps add O(1) per call as well.
+ *
+ * Returns 0 if the heap is still consistent, otherwise a non-zero return code.
+ */
+int check_heap_incremental() {
+    if (++checks_since_sweep > swept_blocks) {
+        return check_heap();
+    }
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        if (arenas[i].dirty_count > DIRTY_LOG_SIZE || arenas[i].dirty_slab_count > DIRTY_LOG_SIZE) {
+            return check_heap();
+        }
+    }
+
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        if (check_dirty(&arenas[i]) || check_dirty_slabs(&arenas[i])) {
+            return -1;
+        }
+        arenas[i].dirty_count = 0;
+        arenas[i].dirty_slab_count = 0;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,2 +1,3 @@
 #include "umalloc.h"
-int check_heap();
\ No newline at end of file
+int check_heap();
+int check_heap_incremental();
\ No newline at end of file
@@ -22,6 +22,12 @@ static void run_trace(trace_t *trace) {
         traceop_t op = trace->ops[curr_op];
         if (op.type == ALLOC) {
             trace->blocks[op.index].payload = umalloc(op.size);
+        } else if (op.type == CALLOC) {
+            trace->blocks[op.index].payload = ucalloc(1, op.size);
+        } else if (op.type == MEMALIGN) {
+            trace->blocks[op.index].payload = umemalign(op.alignment, op.size);
+        } else if (op.type == REALLOC) {
+            trace->blocks[op.index].payload = urealloc(trace->blocks[op.index].payload, op.size);
         } else {
             ufree(trace->blocks[op.index].payload);
         }
@@ -33,13 +39,167 @@ static void run_trace(trace_t *trace) {
 
 
 
+/*
+ * A streamed trace keeps the payload of each allocated id in an open
+ * addressing hash table, which grows with the blocks allocated at once
+ * rather than with every id the trace has. Slots with id -1 are empty.
+ */
+typedef struct {
+    int id;
+    void *payload;
+} id_slot_t;
+
+static id_slot_t *id_slots;
+static size_t id_capacity;
+static size_t id_count;
+
+static size_t id_hash(int id) {
+    return ((uint64_t)id * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+/*
+ * id_resize - rehashes the table into capacity slots.
+ */
+static void id_resize(size_t capacity) {
+    id_slot_t *old = id_slots;
+    size_t old_capacity = id_capacity;
+    id_slots = malloc(capacity * sizeof(id_slot_t));
+    if (id_slots == NULL) {
+        appl_error("Failed to allocate the id table");
+    }
+    id_capacity = capacity;
+    for (size_t i = 0; i < capacity; i++) {
+        id_slots[i].id = -1;
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].id != -1) {
+            size_t slot = id_hash(old[i].id) & (capacity - 1);
+            while (id_slots[slot].id != -1) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            id_slots[slot] = old[i];
+        }
+    }
+    free(old);
+}
+
+/*
+ * id_payload - returns the slot of the payload of id, which holds NULL if id
+ * was not allocated. The slot is added if it is missing, and only stays valid
+ * until the table changes again.
+ */
+static void **id_payload(int id) {
+    if (2 * (id_count + 1) > id_capacity) {
+        id_resize(id_capacity ? 2 * id_capacity : 1024);
+    }
+    size_t slot = id_hash(id) & (id_capacity - 1);
+    while (id_slots[slot].id != id) {
+        if (id_slots[slot].id == -1) {
+            id_slots[slot].id = id;
+            id_slots[slot].payload = NULL;
+            id_count++;
+            break;
+        }
+        slot = (slot + 1) & (id_capacity - 1);
+    }
+    return &id_slots[slot].payload;
+}
+
+/*
+ * id_remove - takes id out of the table, moving back the slots after it that
+ * could not take their own slot, so no lookup stops early at the hole.
+ */
+static void id_remove(int id) {
+    size_t mask = id_capacity - 1;
+    size_t hole = id_hash(id) & mask;
+    while (id_slots[hole].id != id) {
+        if (id_slots[hole].id == -1) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+
+    for (size_t slot = (hole + 1) & mask; id_slots[slot].id != -1; slot = (slot + 1) & mask) {
+        size_t home = id_hash(id_slots[slot].id) & mask;
+        // the slot may move to the hole only if its home is not between them
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            id_slots[hole] = id_slots[slot];
+            hole = slot;
+        }
+    }
+    id_slots[hole].id = -1;
+    id_count--;
+}
+
+/*
+ * stream_trace - replays a trace while it is being read, a chunk at a time,
+ * so the trace may be longer than memory. The time includes waiting for the
+ * parser whenever it falls behind.
+ */
+static void stream_trace(char *filename) {
+    trace_stream_t *stream = open_trace_stream(filename);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uinit();
+    size_t curr_op = 0;
+    traceop_t *ops;
+    for (size_t count = next_trace_chunk(stream, &ops); count > 0; count = next_trace_chunk(stream, &ops)) {
+        for (size_t i = 0; i < count; i++, curr_op++) {
+            if (curr_op % 5 == 0) {
+                sbrk(4096);
+            }
+            traceop_t op = ops[i];
+            if (op.type == ALLOC) {
+                *id_payload(op.index) = umalloc(op.size);
+            } else if (op.type == CALLOC) {
+                *id_payload(op.index) = ucalloc(1, op.size);
+            } else if (op.type == MEMALIGN) {
+                *id_payload(op.index) = umemalign(op.alignment, op.size);
+            } else if (op.type == REALLOC) {
+                void **payload = id_payload(op.index);
+                *payload = urealloc(*payload, op.size);
+            } else {
+                ufree(*id_payload(op.index));
+                id_remove(op.index);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t delta_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    printf("Success: %ld", delta_us);
+
+    close_trace_stream(stream);
+    free(id_slots);
+}
+
 int main(int argc, char **argv) { 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: performance file\n");
+    int c;
+    int display_stats = 0;
+    int stream = 0;
+    while ((c = getopt(argc, argv, "sS")) != -1) {
+        if (c == 's') {
+            display_stats = 1;
+        } else if (c == 'S') {
+            stream = 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: performance [-s] [-S] file\n");
+        fprintf(stderr, "\t-s  Print the allocator statistics after the run.\n");
+        fprintf(stderr, "\t-S  Stream the trace instead of loading it first.\n");
         appl_error("No File parameter provided.");
     }
-    trace_t *trace = read_trace(argv[1], 0);
-    run_trace(trace);
-    free_trace(trace);
+    if (stream) {
+        stream_trace(argv[optind]);
+    } else {
+        trace_t *trace = read_trace(argv[optind], 0);
+        run_trace(trace);
+        free_trace(trace);
+    }
+    if (display_stats) {
+        printf("\n");
+        print_stats();
+    }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,55 @@
+#! /usr/bin/env python3
+# Reports the utilization and throughput of every placement policy on every
+# trace, using the runner_<policy> and performance_<policy> builds.
+import subprocess
+import os
+from tabulate import tabulate
+
+policies = ["first", "next", "best", "good"]
+
+def get_num_ops(trace_file):
+    f = open(trace_file, "r")
+    num_ops = int(f.readlines()[1])
+    return num_ops
+
+def performance_check(policy, trace_file):
+    N = 20
+    total_time = 0
+    num_ops = get_num_ops(trace_file)
+    for i in range(0, N):
+        performance = subprocess.run(["./performance_" + policy, trace_file], universal_newlines=True, stdout=subprocess.PIPE)
+        if 'Success' not in performance.stdout:
+            return -1
+        total_time += int(performance.stdout.split()[1])
+    return (num_ops / max(total_time // N, 1)) * 1000
+
+def utilization_check(policy, trace_file):
+    utilization = subprocess.run(["./runner_" + policy, '-ru', trace_file], universal_newlines=True, stdout=subprocess.PIPE,stderr=subprocess.PIPE)
+    if utilization.returncode != 0 or 'umalloc package passed correctness check.' not in utilization.stdout:
+        return -1
+    return_array = utilization.stdout.split('\n')
+    return float(return_array[4].split()[3])
+
+os.system("make policies")
+traces = sorted(file for file in os.listdir("./traces") if file.endswith(".rep") and 'short' not in file)
+utilization_table = []
+performance_table = []
+for file in traces:
+    trace_file = os.path.join("./traces", file)
+    utilization_table += [[file] + [utilization_check(policy, trace_file) for policy in policies]]
+    performance_table += [[file] + ["{:.2f}".format(performance_check(policy, trace_file)) for policy in policies]]
+
+averages = ["Average"]
+for column in range(1, len(policies) + 1):
+    averages += ["{:.2f}".format(sum(row[column] for row in utilization_table) / max(len(utilization_table), 1))]
+utilization_table += [averages]
+averages = ["Average"]
+for column in range(1, len(policies) + 1):
+    averages += ["{:.2f}".format(sum(float(row[column]) for row in performance_table) / max(len(performance_table), 1))]
+performance_table += [averages]
+
+print("Utilization")
+print(tabulate(utilization_table, headers=["Trace"] + policies))
+print()
+print("Performance (Operations per millisecond)")
+print(tabulate(performance_table, headers=["Trace"] + policies))
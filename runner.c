@@ -12,10 +12,16 @@
 #include "support.h"
 #include "check_heap.h"
 #include <sys/mman.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 int verbose = 0;
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 extern size_t sbrk_bytes;
+extern size_t mmap_bytes;
+extern size_t csbrk_calls;
+extern size_t csbrk_bytes;
 extern const char author[];
 
 /* 
@@ -23,13 +29,127 @@ extern const char author[];
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-rhvuc] file\n");
+    fprintf(stderr, "Usage: mdriver [-rhvucsf] [-i n] file\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-r         Run the trace to completion (bypass interface).\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-v         Print additional debug info.\n");
     fprintf(stderr, "\t-u         Display heap utilization.\n");
-    fprintf(stderr, "\t-c         Runs the user provided heap check after every op.\n");
+    fprintf(stderr, "\t-c         Checks the blocks each op changed, and now and then the whole heap.\n");
+    fprintf(stderr, "\t-s         Print the allocator statistics at the end of the trace.\n");
+    fprintf(stderr, "\t-f         Free blocks through ufree_sized, passing each block's size.\n");
+    fprintf(stderr, "\t-i n       Check every allocated block every n ops (default: as many ops as blocks).\n");
+}
+
+/*
+ * The payloads are filled with and checked against their id through the
+ * kernels below, picked by pick_kernels for the CPU the runner is on: AVX2
+ * or SSE2 on x86-64, one word at a time elsewhere. find_mismatch returns the
+ * index of the first word that is not the id, or words if there is none, and
+ * stops at the first vector holding a wrong word. Blocks of fewer than
+ * SMALL_WORDS words are not worth the indirect call and go word by word.
+ */
+#define SMALL_WORDS 8
+
+static void fill_scalar(size_t *block, size_t words, size_t id) {
+    for (size_t i = 0; i < words; i++) {
+        block[i] = id;
+    }
+}
+
+static size_t find_scalar(const size_t *block, size_t words, size_t id) {
+    for (size_t i = 0; i < words; i++) {
+        if (block[i] != id) {
+            return i;
+        }
+    }
+    return words;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse2")))
+static void fill_sse2(size_t *block, size_t words, size_t id) {
+    __m128i value = _mm_set1_epi64x(id);
+    size_t i = 0;
+    for (; i + 2 <= words; i += 2) {
+        _mm_storeu_si128((__m128i *)(block + i), value);
+    }
+    fill_scalar(block + i, words - i, id);
+}
+
+__attribute__((target("sse2")))
+static size_t find_sse2(const size_t *block, size_t words, size_t id) {
+    __m128i value = _mm_set1_epi64x(id);
+    size_t i = 0;
+    // SSE2 has no 64-bit compare, but two equal halves make an equal word
+    for (; i + 8 <= words; i += 8) {
+        __m128i same = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(block + i)), value),
+                          _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(block + i + 2)), value)),
+            _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(block + i + 4)), value),
+                          _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(block + i + 6)), value)));
+        if (_mm_movemask_epi8(same) != 0xffff) {
+            break;
+        }
+    }
+    for (; i + 2 <= words; i += 2) {
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(block + i)), value)) != 0xffff) {
+            break;
+        }
+    }
+    return i + find_scalar(block + i, words - i, id);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(size_t *block, size_t words, size_t id) {
+    __m256i value = _mm256_set1_epi64x(id);
+    size_t i = 0;
+    for (; i + 4 <= words; i += 4) {
+        _mm256_storeu_si256((__m256i *)(block + i), value);
+    }
+    fill_scalar(block + i, words - i, id);
+}
+
+__attribute__((target("avx2")))
+static size_t find_avx2(const size_t *block, size_t words, size_t id) {
+    __m256i value = _mm256_set1_epi64x(id);
+    size_t i = 0;
+    for (; i + 16 <= words; i += 16) {
+        __m256i same = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(block + i)), value),
+                             _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(block + i + 4)), value)),
+            _mm256_and_si256(_mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(block + i + 8)), value),
+                             _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(block + i + 12)), value)));
+        if (_mm256_movemask_epi8(same) != -1) {
+            break;
+        }
+    }
+    for (; i + 4 <= words; i += 4) {
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(block + i)), value)) != -1) {
+            break;
+        }
+    }
+    return i + find_scalar(block + i, words - i, id);
+}
+#endif
+
+static void (*fill_words)(size_t *block, size_t words, size_t id) = fill_scalar;
+static size_t (*find_mismatch)(const size_t *block, size_t words, size_t id) = find_scalar;
+
+/*
+ * pick_kernels - picks the fastest fill and check kernels the CPU supports.
+ */
+static void pick_kernels(void) {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        fill_words = fill_avx2;
+        find_mismatch = find_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        fill_words = fill_sse2;
+        find_mismatch = find_sse2;
+    }
+#endif
 }
 
 /* 
@@ -37,42 +157,153 @@ static void usage(void)
  * checks.
  */
 static void copy_id(size_t *block, size_t block_size, size_t id) {
-    size_t words = block_size/ sizeof(size_t);
-    for(size_t i = 0; i < words; i++) {
-        block[i] = id;
+    size_t words = block_size / sizeof(size_t);
+    if (words < SMALL_WORDS) {
+        fill_scalar(block, words, id);
+    } else {
+        fill_words(block, words, id);
     }
 }
 
+static size_t bad_offset; /* the byte offset of the first wrong word check_id found */
+
 /* 
  * check_id - Checks the block contains the block id, repeated the number of
- * words can fit.
+ * words can fit. If not, bad_offset gets where the first wrong word is.
  */
 static int check_id(size_t *block, size_t block_size, size_t id) {
     size_t words = block_size/ sizeof(size_t);
-    for(size_t i = 0; i < words; i++) {
-        if (block[i] != id) {
+    size_t bad = (words < SMALL_WORDS) ? find_scalar(block, words, id) : find_mismatch(block, words, id);
+    if (bad != words) {
+        bad_offset = bad * sizeof(size_t);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * The allocated blocks of a trace are also kept in a treap ordered by payload
+ * address, so after each op only the blocks physically next to the payload it
+ * touched have to be checked. Every block is checked in full when it is
+ * freed, and check_correctness sweeps the blocks in the treap every
+ * sweep_interval ops, or by default after as many ops as there are blocks
+ * allocated, so the sweeps cost O(1) per op on average.
+ */
+#define EDGE_WORDS 4 /* words checked at each end of a block next to an op */
+
+typedef struct {
+    int left;           /* the id of the child with lower addresses, or -1 */
+    int right;          /* the id of the child with higher addresses, or -1 */
+    unsigned priority;  /* a random heap priority that keeps the treap balanced */
+} addr_node_t;
+
+static addr_node_t *addr_nodes;
+static int addr_root = -1;
+static size_t live_blocks;
+static size_t sweep_interval;
+static size_t ops_since_sweep;
+static int sized_frees; /* set by -f: free through ufree_sized instead of ufree */
+
+/*
+ * addr_merge - joins two treaps, where every address in left is lower than
+ * any in right, and returns the root.
+ */
+static int addr_merge(int left, int right) {
+    if (left == -1) {
+        return right;
+    }
+    if (right == -1) {
+        return left;
+    }
+
+    if (addr_nodes[left].priority > addr_nodes[right].priority) {
+        addr_nodes[left].right = addr_merge(addr_nodes[left].right, right);
+        return left;
+    }
+    addr_nodes[right].left = addr_merge(left, addr_nodes[right].left);
+    return right;
+}
+
+/*
+ * addr_split - splits the treap at root into the blocks with payloads below
+ * key and those at key or above.
+ */
+static void addr_split(trace_t *trace, int root, char *key, int *left, int *right) {
+    if (root == -1) {
+        *left = -1;
+        *right = -1;
+    } else if ((char *)trace->blocks[root].payload < key) {
+        addr_split(trace, addr_nodes[root].right, key, &addr_nodes[root].right, right);
+        *left = root;
+    } else {
+        addr_split(trace, addr_nodes[root].left, key, left, &addr_nodes[root].left);
+        *right = root;
+    }
+}
+
+/*
+ * addr_insert - adds an allocated block to the address treap.
+ */
+static void addr_insert(trace_t *trace, int id) {
+    int left, right;
+    addr_nodes[id].left = -1;
+    addr_nodes[id].right = -1;
+    addr_nodes[id].priority = rand();
+    addr_split(trace, addr_root, trace->blocks[id].payload, &left, &right);
+    addr_root = addr_merge(addr_merge(left, id), right);
+    live_blocks++;
+}
+
+/*
+ * addr_remove - takes a block out of the treap at root and returns the root.
+ */
+static int addr_remove(trace_t *trace, int root, int id) {
+    if (root == -1) {
+        return -1;
+    }
+    if (root == id) {
+        return addr_merge(addr_nodes[id].left, addr_nodes[id].right);
+    }
+
+    if ((char *)trace->blocks[id].payload < (char *)trace->blocks[root].payload) {
+        addr_nodes[root].left = addr_remove(trace, addr_nodes[root].left, id);
+    } else {
+        addr_nodes[root].right = addr_remove(trace, addr_nodes[root].right, id);
+    }
+    return root;
+}
+
+/*
+ * check_subtree - checks every block in the treap at node has the correct id
+ * written out, lowest address first.
+ */
+static int check_subtree(trace_t *trace, int node, size_t curr_op) {
+    for (; node != -1; node = addr_nodes[node].right) {
+        if (check_subtree(trace, addr_nodes[node].left, curr_op) == -1) {
+            return -1;
+        }
+        allocated_block_t *block = &trace->blocks[node];
+        if (check_id(block->payload, block->block_size, block->content_val) == -1) {
+            sprintf(msg, "umalloc corrupted block id %d at byte %lu of %lu.", node, bad_offset,
+                    block->block_size);
+            malloc_error(curr_op, msg);
             return -1;
         }
     }
-
     return 0;
 }
 
 /* 
  * check_correctness - Checks if every block that is mark allocated has the 
  * correct id written out. If this fails, means that an allocated payload
- * was affected by the umalloc package. 
+ * was affected by the umalloc package. The blocks are found through the
+ * address treap, which holds exactly the allocated ones, so a sweep costs
+ * O(live_blocks) however many ids the trace has.
  */
 static int check_correctness(trace_t *trace, size_t curr_op) {
-    for (size_t block_id = 0; block_id < trace->num_ids; block_id++) {
-        allocated_block_t *block = &trace->blocks[block_id];
-        if (block->is_allocated) {
-            if (check_id(block->payload, block->block_size, block->content_val) == -1) {
-                sprintf(msg, "umalloc corrupted block id %lu.", block_id);
-                malloc_error(curr_op, msg);
-                return -1;
-            }
-        }
+    if (check_subtree(trace, addr_root, curr_op) == -1) {
+        return -1;
     }
 
     if (verbose) {
@@ -82,16 +313,93 @@ static int check_correctness(trace_t *trace, size_t curr_op) {
     return 0;
 }
 
+/*
+ * check_edges - checks the first and last EDGE_WORDS words of a block still
+ * hold its id, which is where a header, footer or link written by mistake
+ * into it would land.
+ */
+static int check_edges(allocated_block_t *block) {
+    size_t words = block->block_size / sizeof(size_t);
+    size_t edge = (words < EDGE_WORDS) ? words : EDGE_WORDS;
+    size_t *payload = block->payload;
+    if (check_id(payload, edge * sizeof(size_t), block->content_val) == -1) {
+        return -1;
+    }
+    if (check_id(payload + words - edge, edge * sizeof(size_t), block->content_val) == -1) {
+        bad_offset += (words - edge) * sizeof(size_t);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * check_near - checks the allocated blocks right below and above the size
+ * bytes at payload that the last op touched: that neither overlaps them, and
+ * that their edges are intact. The block the bytes belong to must not be in
+ * the treap.
+ */
+static int check_near(trace_t *trace, char *payload, size_t size, size_t curr_op) {
+    int near[2] = {-1, -1};
+    for (int node = addr_root; node != -1;) {
+        if ((char *)trace->blocks[node].payload < payload) {
+            near[0] = node;
+            node = addr_nodes[node].right;
+        } else {
+            near[1] = node;
+            node = addr_nodes[node].left;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (near[i] == -1) {
+            continue;
+        }
+        allocated_block_t *block = &trace->blocks[near[i]];
+        char *start = block->payload;
+        if (start == payload || (start < payload && start + block->block_size > payload) ||
+            (start > payload && start < payload + size)) {
+            sprintf(msg, "umalloc returned a payload that overlaps block id %d.", near[i]);
+            malloc_error(curr_op, msg);
+            return -1;
+        }
+        if (check_edges(block) == -1) {
+            sprintf(msg, "umalloc corrupted block id %d at byte %lu of %lu.", near[i], bad_offset,
+                    block->block_size);
+            malloc_error(curr_op, msg);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 size_t curr_bytes_in_use;
 size_t max_bytes_in_use;
+size_t max_heap_bytes;
 
 /* 
  * UTILIZATION_SCORE - the utilization score represents how well the umalloc
  * package uses the bytes requested from sbrk. For example, if 100 bytes are
  * requested from sbrk, and the user requested 80 bytes, there will be a 
- * utilization score of 80%.
+ * utilization score of 80%. The heap is measured at its largest, counting the
+ * mappings umalloc gives slabs and huge blocks, since it may shrink again.
  */
-#define UTILIZATION_SCORE 100.0 * max_bytes_in_use / sbrk_bytes
+#define UTILIZATION_SCORE 100.0 * max_bytes_in_use / max_heap_bytes
+
+/*
+ * in_bounds - checks that a payload lies in memory from sbrk, or in a mapping
+ * umalloc made for its slab or for it alone.
+ */
+static int in_bounds(void *payload, size_t size) {
+    slab_t *slab = get_slab(payload);
+    if (slab != NULL) {
+        return (char *)payload + size <= (char *)slab + PAGESIZE ? 0 : -1;
+    }
+    if (is_mmapped(get_block(payload))) {
+        return get_size(get_block(payload)) >= size ? 0 : -1;
+    }
+    return check_malloc_output(payload, size);
+}
 
 /* 
  * run_trace_line - Runs a single line in the trace. Checking if all the 
@@ -107,7 +415,8 @@ static int run_trace_line(trace_t *trace, size_t curr_op, int utilization, int r
         mprotect(ret, 4096, PROT_NONE);
     }
     traceop_t op = trace->ops[curr_op];
-    if (op.type == ALLOC) {
+    if (op.type == ALLOC || op.type == CALLOC || op.type == MEMALIGN) {
+        size_t alignment = (op.type == MEMALIGN && op.alignment > ALIGNMENT) ? op.alignment : ALIGNMENT;
         trace->blocks[op.index].is_allocated = true;
         trace->blocks[op.index].content_val = curr_op;
         trace->blocks[op.index].block_size = op.size;
@@ -116,41 +425,137 @@ static int run_trace_line(trace_t *trace, size_t curr_op, int utilization, int r
             printf("line %ld: umalloc: id %d, Allocating %d bytes\n", LINENUM(curr_op), op.index, op.size);
         }
 
-        trace->blocks[op.index].payload = umalloc(op.size);
+        if (op.type == CALLOC) {
+            trace->blocks[op.index].payload = ucalloc(1, op.size);
+        } else if (op.type == MEMALIGN) {
+            trace->blocks[op.index].payload = umemalign(op.alignment, op.size);
+        } else {
+            trace->blocks[op.index].payload = umalloc(op.size);
+        }
         curr_bytes_in_use += op.size;
         if ( trace->blocks[op.index].payload == NULL) {
             malloc_error(curr_op, "umalloc failed.");
             return -1;
         }
 
-        if (((size_t)trace->blocks[op.index].payload) % ALIGNMENT != 0) {
+        if (((size_t)trace->blocks[op.index].payload) % alignment != 0) {
             malloc_error(curr_op, "umalloc returned an unaligned payload.");
             return -1;
         }
 
-        if(check_malloc_output(trace->blocks[op.index].payload, trace->blocks[op.index].block_size) == -1) {
+        if(in_bounds(trace->blocks[op.index].payload, trace->blocks[op.index].block_size) == -1) {
             printf("line %ld: umalloc allocated a block out of bounds.\n", LINENUM(curr_op));
             return -1;
         }
 
+        if (op.type == CALLOC) {
+            unsigned char *bytes = trace->blocks[op.index].payload;
+            for (size_t i = 0; i < op.size; i++) {
+                if (bytes[i] != 0) {
+                    malloc_error(curr_op, "ucalloc returned a payload that is not zeroed.");
+                    return -1;
+                }
+            }
+        }
+
+        if (check_near(trace, trace->blocks[op.index].payload, op.size, curr_op) == -1) {
+            return -1;
+        }
+        addr_insert(trace, op.index);
+
         copy_id((size_t*) trace->blocks[op.index].payload, trace->blocks[op.index].block_size, curr_op);
+    } else if (op.type == REALLOC) {
+        allocated_block_t *block = &trace->blocks[op.index];
+        size_t old_size = block->is_allocated ? block->block_size : 0;
+        size_t kept_size = old_size < op.size ? old_size : op.size;
+        char *old_payload = block->is_allocated ? block->payload : NULL;
+        if (block->is_allocated) {
+            addr_root = addr_remove(trace, addr_root, op.index);
+            live_blocks--;
+        }
+
+        if (verbose) {
+            printf("line %ld: urealloc: id %d, Resizing to %d bytes\n", LINENUM(curr_op), op.index, op.size);
+        }
+
+        block->payload = urealloc(block->is_allocated ? block->payload : NULL, op.size);
+        curr_bytes_in_use += op.size - old_size;
+        if (block->payload == NULL) {
+            malloc_error(curr_op, "urealloc failed.");
+            return -1;
+        }
+
+        if (((size_t)block->payload) % ALIGNMENT != 0) {
+            malloc_error(curr_op, "urealloc returned an unaligned payload.");
+            return -1;
+        }
+
+        if(in_bounds(block->payload, op.size) == -1) {
+            printf("line %ld: urealloc allocated a block out of bounds.\n", LINENUM(curr_op));
+            return -1;
+        }
+
+        // the part of the old payload that still fits must have been kept
+        if (check_id(block->payload, kept_size, block->content_val) == -1) {
+            sprintf(msg, "urealloc did not keep the contents of block id %d at byte %lu of %lu.", op.index,
+                    bad_offset, kept_size);
+            malloc_error(curr_op, msg);
+            return -1;
+        }
+
+        // the blocks around where the payload was and where it is now
+        if ((old_payload && check_near(trace, old_payload, old_size, curr_op) == -1) ||
+            check_near(trace, block->payload, op.size, curr_op) == -1) {
+            return -1;
+        }
+
+        block->is_allocated = true;
+        block->content_val = curr_op;
+        block->block_size = op.size;
+        addr_insert(trace, op.index);
+        copy_id((size_t*) block->payload, block->block_size, curr_op);
     } else {
-        trace->blocks[op.index].is_allocated = false;
+        allocated_block_t *block = &trace->blocks[op.index];
+        block->is_allocated = false;
 
         if (verbose) {
             printf("line %ld: ufree: id %d\n", LINENUM(curr_op), op.index);
         }
 
-        ufree(trace->blocks[op.index].payload);
-        curr_bytes_in_use -= trace->blocks[op.index].block_size;
+        // a block is checked in full one last time before it goes back
+        if (check_id(block->payload, block->block_size, block->content_val) == -1) {
+            sprintf(msg, "umalloc corrupted block id %d at byte %lu of %lu.", op.index, bad_offset,
+                    block->block_size);
+            malloc_error(curr_op, msg);
+            return -1;
+        }
+        addr_root = addr_remove(trace, addr_root, op.index);
+        live_blocks--;
+
+        // ufree checks for invalid and double frees, so it stays the default; -f tests the sized path
+        if (sized_frees) {
+            ufree_sized(block->payload, block->block_size);
+        } else {
+            ufree(block->payload);
+        }
+        curr_bytes_in_use -= block->block_size;
+
+        if (check_near(trace, block->payload, block->block_size, curr_op) == -1) {
+            return -1;
+        }
     }
 
     if (curr_bytes_in_use > max_bytes_in_use) {
         max_bytes_in_use = curr_bytes_in_use;
     }
+    if (sbrk_bytes + mmap_bytes > max_heap_bytes) {
+        max_heap_bytes = sbrk_bytes + mmap_bytes;
+    }
 
+    // only the blocks the op changed are checked, with a sweep of the whole
+    // heap every so often
     if (run_check_heap) {
-        if (check_heap() != 0) {
+        if (check_heap_incremental() != 0) {
             malloc_error(curr_op, "check heap failed.");
             return -1;
         } else {
@@ -158,9 +563,12 @@ static int run_trace_line(trace_t *trace, size_t curr_op, int utilization, int r
         }
     }
 
-    if (check_correctness(trace, curr_op) == -1) {
-        printf("line %ld failed the correctness check.\n", LINENUM(curr_op));
-        return -1;
+    if (++ops_since_sweep >= (sweep_interval ? sweep_interval : live_blocks)) {
+        ops_since_sweep = 0;
+        if (check_correctness(trace, curr_op) == -1) {
+            printf("line %ld failed the correctness check.\n", LINENUM(curr_op));
+            return -1;
+        }
     }
 
     if (verbose && utilization) {
@@ -188,10 +596,28 @@ static int auto_run_trace(trace_t *trace, int utilization, int run_check_heap, s
         }
     }
 
+    if (run_check_heap && check_heap() != 0) {
+        malloc_error(curr_op - 1, "check heap failed.");
+        printf("umalloc package failed.\n");
+        exit(1);
+    }
+    if (check_correctness(trace, curr_op - 1) == -1) {
+        printf("umalloc package failed.\n");
+        exit(1);
+    }
+
     printf("umalloc package passed correctness check.\n");
 
     if (utilization) {
         printf("Final Utilization percentage: %.2f\n", UTILIZATION_SCORE);
+        printf("csbrk calls: %lu for %lu bytes\n", csbrk_calls, csbrk_bytes);
+        // pages released inside the heap leave memory without shrinking it
+        umalloc_stats_t before, after;
+        umalloc_stats(&before);
+        utrim(0);
+        umalloc_stats(&after);
+        printf("Heap bytes after trimming: %lu of %lu\n", sbrk_bytes + mmap_bytes, max_heap_bytes);
+        printf("Resident heap bytes trimmed from %lu to %lu\n", before.resident_bytes, after.resident_bytes);
     }
     return curr_op;
 }
@@ -205,6 +631,7 @@ void help() {
     printf("run n            -  execute trace for n ops\n");
     printf("check            -  run the heap_check                \n");
     printf("util             -  display current heap utilization   \n");
+    printf("trim             -  give unused heap memory back       \n");
     printf("help             -  display this help menu            \n");
     printf("quit             -  exit the program                  \n\n");
 }
@@ -218,6 +645,7 @@ void interactive_run_trace(trace_t *trace, int utilization, int run_check_heap)
   int ops_to_run;
   int ret;
   size_t curr_op = 0;
+  umalloc_stats_t before, after;
 
   while(1) {
     printf("MM> ");
@@ -257,6 +685,15 @@ void interactive_run_trace(trace_t *trace, int utilization, int run_check_heap)
         printf("Current Utilization percentage: %.2f\n", UTILIZATION_SCORE);
         break;
 
+    case 'T':
+    case 't':
+        umalloc_stats(&before);
+        utrim(0);
+        umalloc_stats(&after);
+        printf("Heap bytes after trimming: %lu\n", sbrk_bytes + mmap_bytes);
+        printf("Resident heap bytes trimmed from %lu to %lu\n", before.resident_bytes, after.resident_bytes);
+        break;
+
     case 'R':
     case 'r':
         size = scanf("%d", &ops_to_run);
@@ -299,12 +736,12 @@ int main(int argc, char **argv)
 {
 
   char c;
-  int autorun = 0, run_check_heap = 0, display_utilization = 0;
+  int autorun = 0, run_check_heap = 0, display_utilization = 0, display_stats = 0;
 
   /* 
     * Read and interpret the command line arguments 
     */
-  while ((c = getopt(argc, argv, "rvhcu")) != EOF) {
+  while ((c = getopt(argc, argv, "rvhcusfi:")) != EOF) {
     switch (c) {
     case 'r': /* Generate summary info for the autograder */
         autorun = 1;
@@ -321,6 +758,15 @@ int main(int argc, char **argv)
     case 'u':
         display_utilization = 1;
         break;
+    case 's':
+        display_stats = 1;
+        break;
+    case 'f':
+        sized_frees = 1;
+        break;
+    case 'i':
+        sweep_interval = strtoul(optarg, NULL, 10);
+        break;
     default:
         usage();
         exit(1);
@@ -351,17 +797,27 @@ int main(int argc, char **argv)
     printf("Welcome to the MM lab runner\n\n");
     printf("Author: %s\n", author);
 
+    pick_kernels();
     trace_t *trace = read_trace(file, verbose);
+    addr_nodes = malloc(trace->num_ids * sizeof(addr_node_t));
+    if (addr_nodes == NULL) {
+        appl_error("Failed to allocate the address treap.");
+    }
     if (uinit() == -1) {
         malloc_error(-3, "uinit failed.");
         exit(1);
     }
     curr_bytes_in_use = 0;
     max_bytes_in_use = 0;
+    max_heap_bytes = sbrk_bytes + mmap_bytes;
     if (autorun) {
         auto_run_trace(trace, display_utilization, run_check_heap, 0);
     } else {
         interactive_run_trace(trace, display_utilization, run_check_heap);
     }
+    if (display_stats) {
+        print_stats();
+    }
+    free(addr_nodes);
     free_trace(trace);
 }
\ No newline at end of file
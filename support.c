@@ -9,6 +9,11 @@
 
 #include "support.h"
 #include "err_handler.h"
+#include "umalloc.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
@@ -34,7 +39,86 @@ void malloc_error(int opnum, char *msg)
 }
 
 /*
- * read_trace - read a trace file and store it in memory
+ * check_header - exits unless a compiled trace header was written by a build
+ * with the same op records as this one.
+ */
+static void check_header(trace_header_t *header, char *filename)
+{
+    if (header->version != TRACE_VERSION || header->op_size != sizeof(traceop_t) ||
+        header->num_ids < 0 || header->num_ops < 0) {
+        sprintf(msg, "Compiled trace %s does not match this build, compile it again", filename);
+        appl_error(msg);
+    }
+}
+
+/*
+ * check_op - exits unless an op read from a compiled trace names an id below
+ * num_ids, a known type and a size that is not negative, as trace compile
+ * checked, so a corrupted file cannot send the runners out of bounds.
+ */
+static void check_op(traceop_t *op, int num_ids, char *filename)
+{
+    if (op->index < 0 || op->index >= num_ids || op->size < 0 ||
+        (op->type != ALLOC && op->type != FREE && op->type != REALLOC && op->type != CALLOC &&
+         op->type != MEMALIGN)) {
+        sprintf(msg, "Compiled trace %s has a bad op, compile it again", filename);
+        appl_error(msg);
+    }
+}
+
+/*
+ * map_trace - maps a compiled trace into the trace record, checking its
+ * header agrees with the size of the file and every op with check_op.
+ */
+static trace_t *map_trace(char *filename, trace_t *trace)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        sprintf(msg, "Could not open %s in read_trace", filename);
+        appl_error(msg);
+    }
+
+    size_t size = st.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        sprintf(msg, "Could not map %s in read_trace", filename);
+        appl_error(msg);
+    }
+
+    trace_header_t *header = mapping;
+    if (size < sizeof(trace_header_t)) {
+        sprintf(msg, "Compiled trace %s is cut short", filename);
+        appl_error(msg);
+    }
+    check_header(header, filename);
+    if (size != sizeof(trace_header_t) + (size_t)header->num_ops * sizeof(traceop_t)) {
+        sprintf(msg, "Compiled trace %s is cut short", filename);
+        appl_error(msg);
+    }
+
+    // the ops are checked and replayed in order, once each
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    trace->ops = (traceop_t *)(header + 1);
+    for (int i = 0; i < trace->num_ops; i++)
+        check_op(&trace->ops[i], trace->num_ids, filename);
+    trace->mapping = mapping;
+    trace->mapping_size = size;
+
+    trace->blocks = (allocated_block_t *)calloc(trace->num_ids, sizeof(allocated_block_t));
+    if (trace->blocks == NULL)
+        appl_error("Failed to allocate block array");
+
+    return trace;
+}
+
+/*
+ * read_trace - read a trace file and store it in memory. A compiled trace is
+ * mapped instead.
  */
 trace_t *read_trace(char *filename, int verbose)
 {
@@ -56,6 +140,15 @@ trace_t *read_trace(char *filename, int verbose)
         appl_error(msg);
     }
 
+    char magic[sizeof(TRACE_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), tracefile) == sizeof(magic) && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) {
+        fclose(tracefile);
+        return map_trace(filename, trace);
+    }
+    rewind(tracefile);
+    trace->mapping = NULL;
+    trace->mapping_size = 0;
+
     err = fscanf(tracefile, "%d", &(trace->num_ids)); 
     if (err == EOF) {
         appl_error("fscanf failed to find num ids.");
@@ -82,6 +175,7 @@ trace_t *read_trace(char *filename, int verbose)
     unsigned op_index = 0;
     unsigned max_index = 0;
     unsigned size = 0;
+    unsigned alignment = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
         switch(type[0]) {
         case 'a':
@@ -94,6 +188,40 @@ trace_t *read_trace(char *filename, int verbose)
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
+        case 'r':
+            err = fscanf(tracefile, "%u %u", &index, &size);
+            if (err == EOF) {
+                appl_error("fscanf failed to find index and size.");
+            }
+            trace->ops[op_index].type = REALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'c':
+            err = fscanf(tracefile, "%u %u", &index, &size);
+            if (err == EOF) {
+                appl_error("fscanf failed to find index and size.");
+            }
+            trace->ops[op_index].type = CALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'm':
+            err = fscanf(tracefile, "%u %u %u", &index, &size, &alignment);
+            if (err == EOF) {
+                appl_error("fscanf failed to find index, size and alignment.");
+            }
+            if (alignment > MAX_TRACE_ALIGNMENT) {
+                appl_error("memalign alignment too large for a trace.");
+            }
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].alignment = alignment;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         case 'f':
             err = fscanf(tracefile, "%ud", &index);
             if (err == EOF) {
@@ -122,7 +250,254 @@ trace_t *read_trace(char *filename, int verbose)
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the two arrays... */
+    if (trace->mapping) {     /* free the two arrays... */
+        munmap(trace->mapping, trace->mapping_size);
+    } else {
+        free(trace->ops);
+    }
     free(trace->blocks);      
     free(trace);              /* and the trace record itself... */
-}
\ No newline at end of file
+}
+
+/*
+ * write_trace - write a trace out as a compiled trace, returning -1 if the
+ * file could not be written.
+ */
+int write_trace(trace_t *trace, char *filename)
+{
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.op_size = sizeof(traceop_t);
+    header.num_ids = trace->num_ids;
+    header.num_ops = trace->num_ops;
+
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL) {
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, out) != (size_t)trace->num_ops) {
+        fclose(out);
+        return -1;
+    }
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+/*
+ * parse_op - parses one request line of a text trace into op. Returns 0 for
+ * a blank line, 1 for a request, and exits on anything else.
+ */
+static int parse_op(char *line, traceop_t *op, char *filename)
+{
+    char *cur = line;
+    while (*cur == ' ' || *cur == '\t' || *cur == '\r' || *cur == '\n')
+        cur++;
+    if (*cur == '\0')
+        return 0;
+
+    char type = *cur++;
+    int fields = (type == 'f') ? 1 : (type == 'm') ? 3 : 2;
+    unsigned long values[3] = {0, 0, 0};
+    for (int i = 0; i < fields; i++) {
+        char *end;
+        values[i] = strtoul(cur, &end, 10);
+        if (end == cur) {
+            sprintf(msg, "Missing fields after (%c) in tracefile %s", type, filename);
+            appl_error(msg);
+        }
+        cur = end;
+    }
+
+    memset(op, 0, sizeof(*op));
+    switch (type) {
+    case 'a': op->type = ALLOC; break;
+    case 'r': op->type = REALLOC; break;
+    case 'c': op->type = CALLOC; break;
+    case 'm': op->type = MEMALIGN; break;
+    case 'f': op->type = FREE; break;
+    default:
+        sprintf(msg, "Bogus type character (%c) in tracefile %s\n", type, filename);
+        appl_error(msg);
+    }
+    if (values[2] > MAX_TRACE_ALIGNMENT)
+        appl_error("memalign alignment too large for a trace.");
+
+    // ids and sizes are stored as int, and a negative id would stand for an
+    // empty slot in the id table of performance -S
+    if (values[0] > INT_MAX || values[1] > INT_MAX) {
+        sprintf(msg, "Id or size out of range after (%c) in tracefile %s", type, filename);
+        appl_error(msg);
+    }
+    op->index = values[0];
+    op->size = values[1];
+    op->alignment = values[2];
+    return 1;
+}
+
+/*
+ * fill_chunk - parses the next ops of a stream into a chunk, returning false
+ * once the trace has no more.
+ */
+static bool fill_chunk(trace_stream_t *stream, trace_chunk_t *chunk)
+{
+    if (stream->compiled) {
+        chunk->num_ops = fread(chunk->ops, sizeof(traceop_t), STREAM_CHUNK_OPS, stream->file);
+        for (size_t i = 0; i < chunk->num_ops; i++)
+            check_op(&chunk->ops[i], stream->num_ids, stream->filename);
+        return chunk->num_ops > 0;
+    }
+
+    char line[MAXLINE];
+    chunk->num_ops = 0;
+    while (chunk->num_ops < STREAM_CHUNK_OPS && fgets(line, sizeof(line), stream->file)) {
+        chunk->num_ops += parse_op(line, &chunk->ops[chunk->num_ops], stream->filename);
+    }
+    return chunk->num_ops > 0;
+}
+
+/*
+ * parse_stream - the parser thread of a stream, which fills every chunk the
+ * reader is not holding or has yet to take.
+ */
+static void *parse_stream(void *arg)
+{
+    trace_stream_t *stream = arg;
+    bool more = true;
+    pthread_mutex_lock(&stream->lock);
+    while (more && !stream->stopped) {
+        size_t used = stream->filled + stream->reading;
+        if (used == STREAM_CHUNKS) {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+            continue;
+        }
+
+        // the chunk is not the reader's until filled counts it
+        trace_chunk_t *chunk = &stream->chunks[(stream->first + used) % STREAM_CHUNKS];
+        pthread_mutex_unlock(&stream->lock);
+        more = fill_chunk(stream, chunk);
+        pthread_mutex_lock(&stream->lock);
+        if (more)
+            stream->filled++;
+        pthread_cond_broadcast(&stream->changed);
+    }
+    stream->done = true;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+/*
+ * open_trace_stream - opens a trace to be read a chunk at a time and starts
+ * parsing it.
+ */
+trace_stream_t *open_trace_stream(char *filename)
+{
+    trace_stream_t *stream = calloc(1, sizeof(trace_stream_t));
+    if (stream == NULL)
+        appl_error("Failed to allocate the trace stream");
+
+    if ((stream->file = fopen(filename, "r")) == NULL) {
+        sprintf(msg, "Could not open %s in open_trace_stream", filename);
+        appl_error(msg);
+    }
+    stream->filename = filename;
+
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, stream->file) == 1 &&
+        memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0) {
+        check_header(&header, filename);
+        stream->compiled = true;
+        stream->num_ids = header.num_ids;
+    } else {
+        int num_ops;
+        rewind(stream->file);
+        if (fscanf(stream->file, "%d %d", &stream->num_ids, &num_ops) != 2)
+            appl_error("fscanf failed to find num ids and num ops.");
+    }
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+    if (pthread_create(&stream->parser, NULL, parse_stream, stream) != 0)
+        appl_error("Failed to start the trace parser");
+    return stream;
+}
+
+/*
+ * next_trace_chunk - hands the chunk the reader holds back to the parser and
+ * takes the next one, pointing ops at its ops. Returns how many ops it has,
+ * or 0 at the end of the trace.
+ */
+size_t next_trace_chunk(trace_stream_t *stream, traceop_t **ops)
+{
+    pthread_mutex_lock(&stream->lock);
+    if (stream->reading) {
+        stream->first = (stream->first + 1) % STREAM_CHUNKS;
+        stream->reading = false;
+        pthread_cond_broadcast(&stream->changed);
+    }
+    while (stream->filled == 0 && !stream->done)
+        pthread_cond_wait(&stream->changed, &stream->lock);
+
+    size_t num_ops = 0;
+    if (stream->filled > 0) {
+        stream->filled--;
+        stream->reading = true;
+        *ops = stream->chunks[stream->first].ops;
+        num_ops = stream->chunks[stream->first].num_ops;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return num_ops;
+}
+
+/*
+ * close_trace_stream - stops the parser and frees the stream.
+ */
+void close_trace_stream(trace_stream_t *stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->stopped = true;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+
+    pthread_join(stream->parser, NULL);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->changed);
+    fclose(stream->file);
+    free(stream);
+}
+
+/*
+ * print_stats - Print what umalloc_stats reports about the heap
+ */
+void print_stats(void)
+{
+    umalloc_stats_t stats;
+    umalloc_stats(&stats);
+
+    printf("Free blocks: %lu holding %lu bytes, the largest %lu bytes\n",
+           stats.free_blocks, stats.free_bytes, stats.largest_free);
+    printf("Header bytes: %lu\n", stats.header_bytes);
+    printf("Resident bytes: %lu\n", stats.resident_bytes);
+    if (!stats.counted) {
+        printf("Helper calls are only counted when built with UMALLOC_STATS (make stats).\n");
+        return;
+    }
+
+    printf("find: %lu, extend: %lu\n", stats.find_calls, stats.extend_calls);
+    printf("split: %lu, %.2f%% split the block\n", stats.split_calls,
+           stats.split_calls ? 100.0 * stats.splits / stats.split_calls : 0.0);
+    printf("coalesce: %lu, %.2f%% merged with a neighbor\n", stats.coalesce_calls,
+           stats.coalesce_calls ? 100.0 * stats.merges / stats.coalesce_calls : 0.0);
+    printf("Free blocks looked at per find:\n");
+    for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        size_t low = bucket ? (size_t)1 << (bucket - 1) : 0;
+        size_t high = bucket ? ((size_t)1 << bucket) - 1 : 0;
+        if (bucket == STATS_BUCKETS - 1) {
+            printf("  %5lu+      %lu\n", low, stats.search_lengths[bucket]);
+        } else {
+            printf("  %5lu-%-5lu %lu\n", low, high, stats.search_lengths[bucket]);
+        }
+    }
+}
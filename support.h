@@ -17,6 +17,7 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
 
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       2 /* number of header lines in a trace file */
@@ -31,11 +32,15 @@ typedef struct {
 } allocated_block_t;
 
 
-/* Characterizes a single trace operation (allocator request) */
+/* Characterizes a single trace operation (allocator request), packed into
+ * 12 bytes since compiled traces are made of them */
+#define MAX_TRACE_ALIGNMENT ((1 << 24) - 1)
+
 typedef struct {
-    enum {ALLOC, FREE} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, CALLOC, MEMALIGN} type : 8; /* type of request */
+    unsigned alignment : 24;          /* alignment of memalign request, up to MAX_TRACE_ALIGNMENT */
     int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc request */
+    int size;                         /* byte size of alloc or realloc request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -44,9 +49,64 @@ typedef struct {
     int num_ops;         /* number of distinct requests */
     traceop_t *ops;      /* array of requests */
     allocated_block_t *blocks; /* array of blocks returned by umalloc */
+    void *mapping;       /* the mapped compiled trace ops points into, or NULL */
+    size_t mapping_size; /* the length of that mapping */
 } trace_t;
 
+/*
+ * A compiled trace is a trace_header_t followed by num_ops traceop_t records,
+ * in the layout and byte order of the machine that compiled it. read_trace
+ * maps it and uses the records as the ops array without parsing or copying
+ * them, so op_size and version guard against a differently built reader.
+ */
+#define TRACE_MAGIC "MMTRACE"  /* with its terminating zero, 8 bytes */
+#define TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];       /* TRACE_MAGIC */
+    uint32_t version;    /* TRACE_VERSION */
+    uint32_t op_size;    /* sizeof(traceop_t) */
+    int32_t num_ids;
+    int32_t num_ops;
+} trace_header_t;
+
+/*
+ * A trace_stream_t reads a trace, text or compiled, on a parser thread of its
+ * own, which fills a ring of STREAM_CHUNKS chunks of STREAM_CHUNK_OPS ops each
+ * ahead of the reader. A trace of any length is replayed in the same memory,
+ * while the next chunks are being parsed. The chunk next_trace_chunk returns
+ * stays valid until the next call, which hands it back to the parser.
+ */
+#define STREAM_CHUNK_OPS 4096
+#define STREAM_CHUNKS 3
+
+typedef struct {
+    traceop_t ops[STREAM_CHUNK_OPS];
+    size_t num_ops;                   /* ops in the chunk, fewer only in the last one */
+} trace_chunk_t;
+
+typedef struct {
+    FILE *file;
+    char *filename;
+    bool compiled;                    /* the file is a compiled trace */
+    int num_ids;                      /* number of alloc ids */
+    trace_chunk_t chunks[STREAM_CHUNKS];
+    size_t first;                     /* the chunk the reader holds or gets next */
+    size_t filled;                    /* parsed chunks the reader has not taken yet */
+    bool reading;                     /* the reader holds the first chunk */
+    bool done;                        /* the parser reached the end of the trace */
+    bool stopped;                     /* the parser was told to stop */
+    pthread_t parser;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;           /* signalled whenever a chunk is filled or handed back */
+} trace_stream_t;
+
 void appl_error(char *msg);
 void malloc_error(int opnum, char *msg);
 trace_t *read_trace(char *filename, int verbose);
-void free_trace(trace_t *trace);
\ No newline at end of file
+void free_trace(trace_t *trace);
+int write_trace(trace_t *trace, char *filename);
+trace_stream_t *open_trace_stream(char *filename);
+size_t next_trace_chunk(trace_stream_t *stream, traceop_t **ops);
+void close_trace_stream(trace_stream_t *stream);
+void print_stats(void);
\ No newline at end of file
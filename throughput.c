@@ -0,0 +1,245 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * throughput.c - Measures how allocation throughput scales with the number
+ * of threads, using the allocator built with UMALLOC_THREADS
+ **************************************************************************/
+
+#include <stdio.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+#include "umalloc.h"
+
+#define SLOTS 64 /* allocations each thread keeps live at once */
+#define RING_SIZE 1024 /* allocations in flight from a producer to its consumer */
+
+static size_t num_ops = 1000000;
+static size_t max_size = 256;
+static bool pipeline = false;
+static size_t batch = 0;
+static bool batch_loop = false;
+
+/* Hands allocations from one producer thread to one consumer thread */
+typedef struct {
+    void *slots[RING_SIZE];
+    _Atomic size_t head; /* the next slot the consumer takes */
+    _Atomic size_t tail; /* the next slot the producer fills */
+    unsigned int seed;
+} ring_t;
+
+/*
+ * run_thread - randomly allocates into and frees out of a small set of slots,
+ * touching every allocation so the memory is really used.
+ */
+static void *run_thread(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    void *slots[SLOTS] = {NULL};
+
+    for (size_t op = 0; op < num_ops; op++) {
+        int slot = rand_r(&seed) % SLOTS;
+        if (slots[slot]) {
+            ufree(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            size_t size = rand_r(&seed) % max_size + 1;
+            slots[slot] = umalloc(size);
+            if (slots[slot] == NULL) {
+                fprintf(stderr, "umalloc failed to allocate %lu bytes\n", size);
+                exit(1);
+            }
+            *(char *)slots[slot] = (char)op;
+        }
+    }
+
+    for (int slot = 0; slot < SLOTS; slot++) {
+        ufree(slots[slot]);
+    }
+    return NULL;
+}
+
+/*
+ * run_batches - allocates batches of same-size blocks and frees each batch as
+ * a whole, with umalloc_batch and ufree_batch or, for comparison, one block at
+ * a time. Every block counts as an operation.
+ */
+static void *run_batches(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    void *blocks[batch];
+
+    for (size_t op = 0; op < num_ops; op += batch) {
+        size_t size = rand_r(&seed) % max_size + 1;
+        size_t count = batch;
+        if (batch_loop) {
+            for (size_t i = 0; i < batch; i++) {
+                blocks[i] = umalloc(size);
+                if (blocks[i] == NULL) {
+                    count = i;
+                    break;
+                }
+            }
+        } else {
+            count = umalloc_batch(size, batch, blocks);
+        }
+        if (count != batch) {
+            fprintf(stderr, "umalloc failed to allocate %lu bytes\n", size);
+            exit(1);
+        }
+
+        for (size_t i = 0; i < batch; i++) {
+            *(char *)blocks[i] = (char)op;
+        }
+
+        if (batch_loop) {
+            for (size_t i = 0; i < batch; i++) {
+                ufree(blocks[i]);
+            }
+        } else {
+            ufree_batch(blocks, batch);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * run_producer - allocates blocks and hands every one of them to the consumer,
+ * which frees it, so that every free is made by a thread that did not
+ * allocate the block.
+ */
+static void *run_producer(void *arg) {
+    ring_t *ring = arg;
+
+    for (size_t op = 0; op < num_ops; op++) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE) {
+            sched_yield();
+        }
+
+        size_t size = rand_r(&ring->seed) % max_size + 1;
+        void *payload = umalloc(size);
+        if (payload == NULL) {
+            fprintf(stderr, "umalloc failed to allocate %lu bytes\n", size);
+            exit(1);
+        }
+        *(char *)payload = (char)op;
+        ring->slots[tail % RING_SIZE] = payload;
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+/*
+ * run_consumer - frees the blocks its producer hands over.
+ */
+static void *run_consumer(void *arg) {
+    ring_t *ring = arg;
+
+    for (size_t op = 0; op < num_ops; op++) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+            sched_yield();
+        }
+
+        ufree(ring->slots[head % RING_SIZE]);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+/*
+ * run_threads - runs the benchmark on num_threads threads at once and returns
+ * the time it took in microseconds.
+ */
+static uint64_t run_threads(int num_threads) {
+    pthread_t threads[num_threads];
+    struct timespec start, end;
+
+    ring_t rings[num_threads / 2 + 1];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_threads; i++) {
+        int err;
+        if (pipeline) {
+            // even threads produce for the odd thread after them
+            ring_t *ring = &rings[i / 2];
+            if (i % 2 == 0) {
+                atomic_init(&ring->head, 0);
+                atomic_init(&ring->tail, 0);
+                ring->seed = i + 1;
+            }
+            err = pthread_create(&threads[i], NULL, i % 2 ? run_consumer : run_producer, ring);
+        } else {
+            err = pthread_create(&threads[i], NULL, batch ? run_batches : run_thread, (void *)(size_t)(i + 1));
+        }
+        if (err != 0) {
+            fprintf(stderr, "Could not create thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-p | -b batch [-l]] [-t max_threads] [-n ops_per_thread] [-s max_size]\n", prog);
+    fprintf(stderr, "  -p  pair up threads as producers and consumers\n");
+    fprintf(stderr, "  -b  allocate and free blocks in batches of the given count\n");
+    fprintf(stderr, "  -l  make the batches one call at a time, for comparison\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int c;
+
+    while ((c = getopt(argc, argv, "pb:lt:n:s:h")) != -1) {
+        switch (c) {
+        case 'p':
+            pipeline = true;
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            batch_loop = true;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            num_ops = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            max_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (max_threads < 1 || num_ops == 0 || max_size == 0 || (pipeline && batch) || (batch_loop && !batch)) {
+        usage(argv[0]);
+    }
+
+    if (uinit() != 0) {
+        fprintf(stderr, "uinit failed\n");
+        return 1;
+    }
+
+    // each thread does the same work, so perfect scaling keeps the time flat
+    printf("threads  time (us)  Mops/s\n");
+    for (int num_threads = pipeline ? 2 : 1; num_threads <= max_threads; num_threads *= 2) {
+        uint64_t delta_us = run_threads(num_threads);
+        printf("%7d  %9lu  %6.2f\n", num_threads, delta_us,
+               (double)num_ops * num_threads / (delta_us ? delta_us : 1));
+    }
+    return 0;
+}
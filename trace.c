@@ -0,0 +1,45 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ * 
+ * trace.c - Tools for trace files. trace compile turns a .rep trace into a
+ * compiled trace, which runner and performance map instead of parsing.
+ * 
+ * Copyright (c) 2021 M. Hinton. All rights reserved.
+ * May not be used, modified, or copied without permission.
+ **************************************************************************/
+
+#include "support.h"
+
+/*
+ * check_ops - checks every op of a trace names an id the trace has, so a
+ * compiled trace can be replayed without checking it again.
+ */
+static void check_ops(trace_t *trace) {
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t *op = &trace->ops[i];
+        if (op->index < 0 || op->index >= trace->num_ids || op->size < 0 ||
+            (op->type != ALLOC && op->type != FREE && op->type != REALLOC && op->type != CALLOC &&
+             op->type != MEMALIGN)) {
+            malloc_error(i, "bad op in trace.");
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4 || strcmp(argv[1], "compile") != 0) {
+        fprintf(stderr, "Usage: trace compile file.rep compiled_file\n");
+        appl_error("Bad parameters.");
+    }
+
+    trace_t *trace = read_trace(argv[2], 0);
+    check_ops(trace);
+    if (write_trace(trace, argv[3]) == -1) {
+        char msg[MAXLINE];
+        sprintf(msg, "Could not write %s", argv[3]);
+        appl_error(msg);
+    }
+    printf("Compiled %d ops over %d ids into %s\n", trace->num_ops, trace->num_ids, argv[3]);
+    free_trace(trace);
+    return 0;
+}
@@ -132,7 +132,7 @@ foreach $item (@lines) {
 
 # print a set of free requests that will balance the trace
 foreach $key (sort keys %HASH) {
-    if ($HASH{$key} ne "a" and $HASH{$key} ne "r") {
+    if ($HASH{$key} !~ /^[acmr]$/) {
 	die "$0: ERROR: Invalid free request in residue.\n";
     }
     print "f $key\n";
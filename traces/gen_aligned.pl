@@ -0,0 +1,56 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = $argv[0];
+$out_filename = "aligned.rep" unless $out_filename;
+$num_blocks = $argv[1];
+$num_blocks = 1200 unless $num_blocks;
+$max_blk_size = $argv[2];
+$max_blk_size = 8192 unless $max_blk_size;
+@alignments = (32, 64, 256, 4096);
+
+# Create trace
+# Make a series of malloc()s, calloc()s and memalign()s
+for ($i = 0;  $i < $num_blocks; $i += 1) {
+    $size = int(rand $max_blk_size);
+    $op = {};
+    $op->{type} = ("a", "c", "m")[int(rand 3)];
+    $op->{seq} = $i;
+    $op->{size} = $size;
+    $op->{alignment} = $alignments[int(rand @alignments)];
+    push @trace, $op;
+}
+# Insert free()s in proper places
+for ($i = 0;  $i < $num_blocks; $i += 1) {
+    for ($minval = $i; $minval < $num_blocks + $i; $minval += 1) {
+        if (($trace[$minval]->{type} ne "f") && ($trace[$minval]->{seq} == $i)) {
+            last;
+        }
+    }
+    $pos = int(rand($num_blocks + $i - $minval - 1) + $minval + 1);
+    $op = {};
+    $op->{type} = "f";
+    $op->{seq} = $i;
+    splice @trace, $pos, 0, $op;
+}
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Calculate misc parameters
+$num_ops = 2*$num_blocks;
+
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+
+for ($i = 0;  $i < 2*$num_blocks; $i += 1) {
+    if ($trace[$i]->{type} eq "m") {
+        print OUTFILE "$trace[$i]->{type} $trace[$i]->{seq} $trace[$i]->{size} $trace[$i]->{alignment}\n";
+    } elsif ($trace[$i]->{type} ne "f") {
+        print OUTFILE "$trace[$i]->{type} $trace[$i]->{seq} $trace[$i]->{size}\n";
+    } else {
+        print OUTFILE "$trace[$i]->{type} $trace[$i]->{seq}\n";
+    }
+}
+
+close OUTFILE;
@@ -0,0 +1,48 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "huge.rep";
+$num_iters = 200;
+$max_blk_size = 2048;
+$min_buf_size = 128*1024;
+$max_buf_size = 1024*1024;
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Small blocks pile up while big transient buffers come and go, each
+# buffer is freed two steps after it is allocated.
+$seq = 0;
+for ($i = 0;  $i < $num_iters; $i += 1) {
+    $size = int(rand $max_blk_size) + 1;
+    push @lines, "a $seq $size";
+    push @small, $seq++;
+
+    $buf_size = $min_buf_size + int(rand($max_buf_size - $min_buf_size));
+    push @lines, "a $seq $buf_size";
+    push @bufs, $seq++;
+    if (@bufs > 2) {
+        $buf = shift @bufs;
+        push @lines, "f $buf";
+    }
+
+    # every few steps some of the small blocks go away again
+    if ($i % 4 == 3) {
+        $blk = splice(@small, int(rand @small), 1);
+        push @lines, "f $blk";
+    }
+}
+foreach $buf (@bufs) {
+    push @lines, "f $buf";
+}
+
+$num_blocks = $seq;
+$num_ops = @lines;
+
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+foreach $line (@lines) {
+    print OUTFILE "$line\n";
+}
+
+close OUTFILE;
@@ -0,0 +1,35 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "realloc.rep";
+$start_size = 512;
+$vec_step1 = 128;
+$vec_step2 = 64;
+$blk_size = 256;
+$num_iters = 400;
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Calculate misc parameters
+$num_blocks = $num_iters + 2;
+$num_ops = 4*$num_iters + 2;
+
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+
+# Two vectors grow side by side, with a short-lived block allocated
+# between each step so that not every resize can happen in place.
+print OUTFILE "a 0 $start_size\n";
+print OUTFILE "a 1 $start_size\n";
+for ($i = 0;  $i < $num_iters; $i += 1) {
+    $seq = $i + 2;
+    $size1 = $start_size + $vec_step1*($i + 1);
+    $size2 = $start_size + $vec_step2*($i + 1);
+    print OUTFILE "a $seq $blk_size\n";
+    print OUTFILE "r 0 $size1\n";
+    print OUTFILE "r 1 $size2\n";
+    print OUTFILE "f $seq\n";
+}
+
+close OUTFILE;
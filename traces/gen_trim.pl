@@ -0,0 +1,43 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "trim.rep";
+$num_iters = 1000;
+$max_small_size = 128;
+$min_mid_size = 8 * 1024;
+$max_mid_size = 32 * 1024;
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Small and medium blocks fill the heap, one block at the top outlives them
+# all, and everything else is freed, so the heap cannot shrink from the top
+# and only releasing empty slabs and the pages inside free blocks helps.
+$seq = 0;
+for ($i = 0;  $i < $num_iters; $i += 1) {
+    $size = int(rand $max_small_size) + 1;
+    push @lines, "a $seq $size";
+    push @blocks, $seq++;
+
+    if ($i % 4 == 0) {
+        $size = $min_mid_size + int(rand($max_mid_size - $min_mid_size));
+        push @lines, "a $seq $size";
+        push @blocks, $seq++;
+    }
+}
+push @lines, "a $seq 1024";
+$seq++;
+foreach $blk (@blocks) {
+    push @lines, "f $blk";
+}
+
+$num_blocks = $seq;
+$num_ops = @lines;
+
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+foreach $line (@lines) {
+    print OUTFILE "$line\n";
+}
+
+close OUTFILE;
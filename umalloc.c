@@ -1,8 +1,17 @@
+#define _GNU_SOURCE // for mremap
 #include "umalloc.h"
 #include "csbrk.h"
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "ansicolors.h"
+#ifdef UMALLOC_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
 
 const char author[] = ANSI_BOLD ANSI_COLOR_RED "Noor Ali na27858" ANSI_RESET;
 
@@ -11,8 +20,82 @@ const char author[] = ANSI_BOLD ANSI_COLOR_RED "Noor Ali na27858" ANSI_RESET;
  * struct, they can be adjusted as necessary.
  */
 
-// A sample pointer to the start of the free list.
-memory_block_t *free_head;
+// The arenas, each with its own slabs and free structures. Without
+// UMALLOC_THREADS there is only one.
+arena_t arenas[NUM_ARENAS];
+
+_Static_assert((sizeof(region_t) + 2 * HEADER_SIZE) % ALIGNMENT == 0,
+               "region_t must leave the first block of a region aligned");
+_Static_assert(BIN_WORDS <= 64, "bin_summary has one bit per bin_map word");
+_Static_assert(PAGESIZE == 1 << PAGE_SHIFT, "PAGE_SHIFT must match PAGESIZE");
+_Static_assert(PAGE_MAP_LEVELS * PAGE_MAP_BITS + PAGE_SHIFT >= 48, "the page map must cover 48-bit user addresses");
+_Static_assert(TREE_THRESHOLD + HEADER_SIZE >= sizeof(tree_node_t) + sizeof(size_t),
+               "TREE_THRESHOLD is too small to hold a tree node and footer");
+
+// Rounds up to a whole number of pages.
+#define PAGE_ALIGN(size) (((size) + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1))
+
+// Counters and settings shared by every arena.
+#ifdef UMALLOC_THREADS
+#define THREAD_SHARED _Atomic
+#else
+#define THREAD_SHARED
+#endif
+
+// Words that threads of other arenas read without the arena's lock, block
+// headers among them, are only ever loaded and stored whole through these.
+#ifdef UMALLOC_THREADS
+#define SHARED_LOAD(word) __atomic_load_n(&(word), __ATOMIC_RELAXED)
+#define SHARED_STORE(word, value) __atomic_store_n(&(word), (value), __ATOMIC_RELAXED)
+#else
+#define SHARED_LOAD(word) (word)
+#define SHARED_STORE(word, value) ((word) = (value))
+#endif
+
+// The bytes mapped for blocks of their own, the size from which requests get
+// one, and whether that size was set explicitly rather than adapted.
+THREAD_SHARED size_t mmap_bytes;
+static THREAD_SHARED size_t mmap_threshold = MMAP_THRESHOLD;
+static THREAD_SHARED bool mmap_threshold_fixed;
+
+// The calls the heap made to csbrk and the bytes it asked for, which only
+// change under the sbrk lock.
+size_t csbrk_calls;
+size_t csbrk_bytes;
+
+#ifdef UMALLOC_STATS
+// The counters of each arena, which only change under its lock, and how many
+// free blocks the find running in each arena has looked at so far.
+static umalloc_stats_t arena_stats[NUM_ARENAS];
+static size_t find_visits[NUM_ARENAS];
+#define STAT_INC(field) (arena_stats[arena - arenas].field++)
+#define STAT_VISIT() (find_visits[arena - arenas]++)
+#else
+#define STAT_INC(field) ((void)0)
+#define STAT_VISIT() ((void)0)
+#endif
+
+// The root of the page map. Its inner nodes and leaves are mapped when they
+// are first needed, and only given back when uinit starts over.
+static THREAD_SHARED uintptr_t page_map[PAGE_MAP_SIZE];
+
+#ifdef UMALLOC_THREADS
+// The arena the calling thread allocates from, and the arena the next thread
+// to allocate is bound to.
+static __thread arena_t *arena;
+static atomic_uint next_arena;
+
+// Keeps threads of different arenas from calling csbrk at the same time.
+static pthread_mutex_t sbrk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The calling thread's cache, and whether it flushes it when the thread exits.
+static __thread tcache_bin_t tcache[TCACHE_CLASSES];
+static __thread bool tcache_registered;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+#else
+static arena_t *const arena = &arenas[0];
+#endif
 
 /*
  * block_metadata - returns true if a block is marked as allocated.
@@ -20,8 +103,93 @@ memory_block_t *free_head;
 bool is_allocated(memory_block_t *block)
 {
     assert(block != NULL);
-    return block->block_metadata & 0x1;
+    return SHARED_LOAD(block->block_metadata) & 0x1;
+}
+
+/*
+ * is_prev_allocated - returns true if the block physically before this one is
+ * marked as allocated.
+ */
+bool is_prev_allocated(memory_block_t *block)
+{
+    assert(block != NULL);
+    return SHARED_LOAD(block->block_metadata) & 0x2;
+}
+
+/*
+ * is_mmapped - returns true if a block has an anonymous mapping of its own.
+ */
+bool is_mmapped(memory_block_t *block)
+{
+    assert(block != NULL);
+    return SHARED_LOAD(block->block_metadata) & 0x4;
+}
+
+/*
+ * set_prev_allocated - records whether the block physically before this one
+ * is allocated.
+ */
+void set_prev_allocated(memory_block_t *block, bool prev_alloc)
+{
+    assert(block != NULL);
+    if (prev_alloc)
+    {
+        SHARED_STORE(block->block_metadata, SHARED_LOAD(block->block_metadata) | 0x2);
+    }
+    else
+    {
+        SHARED_STORE(block->block_metadata, SHARED_LOAD(block->block_metadata) & ~(size_t)0x2);
+    }
+}
+
+/*
+ * get_footer - gets the footer stored in the last word of a free block.
+ */
+static size_t *get_footer(memory_block_t *block)
+{
+    return (size_t *)((char *)get_payload(block) + get_size(block)) - 1;
+}
+
+#ifdef UMALLOC_CHECK
+/*
+ * log_dirty - adds a block whose header changed to the log of the calling
+ * thread's arena, or marks the log as overflowed if it is full.
+ */
+static void log_dirty(memory_block_t *block)
+{
+    size_t count = arena->dirty_count;
+    if (count < DIRTY_LOG_SIZE)
+    {
+        arena->dirty_blocks[count] = block;
+        arena->dirty_count = count + 1;
+    }
+    else
+    {
+        arena->dirty_count = DIRTY_LOG_SIZE + 1;
+    }
+}
+
+/*
+ * log_slab - adds a slab that handed out or took back a slot to the log of the
+ * calling thread's arena, or marks the log as overflowed if it is full.
+ */
+static void log_slab(slab_t *slab)
+{
+    size_t count = arena->dirty_slab_count;
+    if (count < DIRTY_LOG_SIZE)
+    {
+        arena->dirty_slabs[count] = slab;
+        arena->dirty_slab_count = count + 1;
+    }
+    else
+    {
+        arena->dirty_slab_count = DIRTY_LOG_SIZE + 1;
+    }
 }
+#else
+#define log_dirty(block) ((void)0)
+#define log_slab(slab) ((void)0)
+#endif
 
 /*
  * allocate - marks a block as allocated.
@@ -29,16 +197,22 @@ bool is_allocated(memory_block_t *block)
 void allocate(memory_block_t *block)
 {
     assert(block != NULL);
-    block->block_metadata |= 0x1;
+    SHARED_STORE(block->block_metadata, SHARED_LOAD(block->block_metadata) | 0x1);
+    log_dirty(block);
+#ifdef UMALLOC_THREADS
+    block->next = (memory_block_t *)arena;
+#endif
 }
 
 /*
- * deallocate - marks a block as unallocated.
+ * deallocate - marks a block as unallocated and writes its footer.
  */
 void deallocate(memory_block_t *block)
 {
     assert(block != NULL);
-    block->block_metadata &= ~0x1;
+    SHARED_STORE(block->block_metadata, SHARED_LOAD(block->block_metadata) & ~(size_t)0x1);
+    *get_footer(block) = get_size(block);
+    log_dirty(block);
 }
 
 /*
@@ -47,7 +221,7 @@ void deallocate(memory_block_t *block)
 size_t get_size(memory_block_t *block)
 {
     assert(block != NULL);
-    return block->block_metadata & ~(ALIGNMENT - 1);
+    return SHARED_LOAD(block->block_metadata) & ~(size_t)0x7;
 }
 
 /*
@@ -59,18 +233,42 @@ memory_block_t *get_next(memory_block_t *block)
     return block->next;
 }
 
+/*
+ * get_prev - gets the previous block in the free list.
+ */
+memory_block_t *get_prev(memory_block_t *block)
+{
+    assert(block != NULL);
+    assert(!is_allocated(block));
+    return block->prev;
+}
+
 /*
  * put_block - puts a block struct into memory at the specified address.
- * Initializes the size and allocated fields, along with NUlling out the next
- * field.
+ * Initializes the size and allocated fields. Free blocks also get NULL links
+ * and their footer, while the payload of an allocated block is left alone.
+ * The previous allocated bit is left cleared for the caller to set.
  */
 void put_block(memory_block_t *block, size_t size, bool alloc)
 {
     assert(block != NULL);
-    assert(size % ALIGNMENT == 0);
+    assert(size == 0 || (size + HEADER_SIZE) % ALIGNMENT == 0);
     assert(alloc >> 1 == 0);
-    block->block_metadata = size | alloc;
-    block->next = NULL;
+    SHARED_STORE(block->block_metadata, size | alloc);
+    log_dirty(block);
+    if (alloc)
+    {
+#ifdef UMALLOC_THREADS
+        // allocated blocks keep their arena in the link they do not use
+        block->next = (memory_block_t *)arena;
+#endif
+    }
+    else
+    {
+        block->next = NULL;
+        block->prev = NULL;
+        *get_footer(block) = size;
+    }
 }
 
 /*
@@ -79,7 +277,7 @@ void put_block(memory_block_t *block, size_t size, bool alloc)
 void *get_payload(memory_block_t *block)
 {
     assert(block != NULL);
-    return (void *)(block + 1);
+    return (void *)((char *)block + HEADER_SIZE);
 }
 
 /*
@@ -88,7 +286,7 @@ void *get_payload(memory_block_t *block)
 memory_block_t *get_block(void *payload)
 {
     assert(payload != NULL);
-    return ((memory_block_t *)payload) - 1;
+    return (memory_block_t *)((char *)payload - HEADER_SIZE);
 }
 
 /*
@@ -97,251 +295,2917 @@ memory_block_t *get_block(void *payload)
  */
 
 /*
- * find - finds a free block that can satisfy the umalloc request.
+ * get_bin - returns the index of the size-class bin a block of the given
+ * payload size belongs in.
  */
-memory_block_t *find(size_t size)
+int get_bin(size_t size)
 {
-    // first fit search for a block satisfying the size in the list
-    memory_block_t *find_block = free_head;
+    assert(size >= MIN_BLOCK_SIZE);
 
-    while (find_block)
+    // small sizes each get their own bin
+    if (size <= EXACT_BIN_LIMIT)
     {
-        // checks if a block fits
-        if (get_size(find_block) >= size)
-        {
-            return find_block;
-        }
-        find_block = get_next(find_block);
+        return size / ALIGNMENT - 1;
     }
 
-    return find_block;
+    // larger sizes are grouped by power of two
+    int bin = EXACT_BINS;
+    size_t limit = EXACT_BIN_LIMIT * 2;
+    while (size > limit && bin < NUM_BINS - 1)
+    {
+        limit <<= 1;
+        bin++;
+    }
+    return bin;
 }
 
 /*
- * extend - extends the heap if more memory is required.
+ * tree_height - gets the height of a subtree, which is zero when it is empty.
  */
-memory_block_t *extend(size_t size)
+static size_t tree_height(tree_node_t *node)
 {
-    memory_block_t *extra_block;
+    return node ? node->height : 0;
+}
 
-    // Allocate extra space every call
-    extra_block = csbrk((size / PAGESIZE + 1) * PAGESIZE);
-    put_block(extra_block, (size / PAGESIZE + 1) * PAGESIZE - ALIGNMENT, false);
+/*
+ * tree_fix_height - recomputes the height of a node from its children.
+ */
+static void tree_fix_height(tree_node_t *node)
+{
+    size_t left = tree_height(node->left);
+    size_t right = tree_height(node->right);
+    node->height = (left > right ? left : right) + 1;
+}
 
-    // if nothing given by csbrk return NULL
-    if (extra_block == NULL)
-    {
-        return NULL;
-    }
+/*
+ * tree_rotate_left - rotates the right child of node above it.
+ */
+static tree_node_t *tree_rotate_left(tree_node_t *node)
+{
+    tree_node_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    tree_fix_height(node);
+    tree_fix_height(right);
+    return right;
+}
 
-    return extra_block;
+/*
+ * tree_rotate_right - rotates the left child of node above it.
+ */
+static tree_node_t *tree_rotate_right(tree_node_t *node)
+{
+    tree_node_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    tree_fix_height(node);
+    tree_fix_height(left);
+    return left;
 }
 
 /*
- * perfectFit - returns the block after removing it from the free list
+ * tree_balance - restores the AVL property at node after one of its subtrees
+ * changed height by one, returning the new root of the subtree.
  */
-memory_block_t *perfectFit(memory_block_t *block, size_t size)
+static tree_node_t *tree_balance(tree_node_t *node)
 {
-    memory_block_t *block_before = free_head;
-    // storing next block before it gets nulled
-    memory_block_t *store_block = block->next;
+    tree_fix_height(node);
 
-    // if the block is the head and it perfectly fits move the head and allocates
-    if (block == free_head)
+    if (tree_height(node->left) > tree_height(node->right) + 1)
     {
-        free_head = free_head->next;
-        put_block(block, size, true);
-        return block;
+        if (tree_height(node->left->right) > tree_height(node->left->left))
+        {
+            node->left = tree_rotate_left(node->left);
+        }
+        return tree_rotate_right(node);
     }
 
-    // find the position is being removed and remove it from the list and allocates
-    while (get_next(block_before) && get_next(block_before) != block)
+    if (tree_height(node->right) > tree_height(node->left) + 1)
     {
-        block_before = get_next(block_before);
+        if (tree_height(node->right->left) > tree_height(node->right->right))
+        {
+            node->right = tree_rotate_right(node->right);
+        }
+        return tree_rotate_left(node);
     }
-    block_before->next = store_block;
-    put_block(block, size, true);
-    return block;
+
+    return node;
 }
 
 /*
- * split - splits a given block in parts, one allocated, one free.
+ * tree_insert - adds a free block to the subtree at root, returning the new
+ * root of the subtree. Blocks of a size already in the tree join that node's
+ * list instead of becoming nodes.
  */
-memory_block_t *split(memory_block_t *block, size_t size)
+static tree_node_t *tree_insert(tree_node_t *root, tree_node_t *node)
 {
-    memory_block_t *block_before = free_head;
-    memory_block_t *store_block = block->next;
-    // only occurs after malloc calls
+    if (root == NULL)
+    {
+        node->block.next = NULL;
+        node->block.prev = NULL;
+        node->left = NULL;
+        node->right = NULL;
+        node->height = 1;
+        return node;
+    }
 
-    // allocates an free entire block if it fits perfectly
-    if (size == get_size(block))
+    size_t size = get_size(&node->block);
+    if (size == get_size(&root->block))
     {
-        return perfectFit(block, size);
+        // same size, so link it in right behind the node
+        node->block.next = root->block.next;
+        node->block.prev = &root->block;
+        if (root->block.next)
+        {
+            root->block.next->prev = &node->block;
+        }
+        root->block.next = &node->block;
+        return root;
     }
 
-    memory_block_t *allocated_block = NULL;
-    size_t old_size = get_size(block);
+    if (size < get_size(&root->block))
+    {
+        root->left = tree_insert(root->left, node);
+    }
+    else
+    {
+        root->right = tree_insert(root->right, node);
+    }
+    return tree_balance(root);
+}
 
-    // finds where the block before the free block being allocated
-    while (get_next(block_before) && get_next(block_before) != block)
+/*
+ * tree_remove_min - unlinks the smallest node of a subtree, storing it in min
+ * and returning the new root of the subtree.
+ */
+static tree_node_t *tree_remove_min(tree_node_t *root, tree_node_t **min)
+{
+    if (root->left == NULL)
     {
-        block_before = get_next(block_before);
+        *min = root;
+        return root->right;
     }
+    root->left = tree_remove_min(root->left, min);
+    return tree_balance(root);
+}
+
+/*
+ * tree_remove - unlinks node from the subtree at root, returning the new root
+ * of the subtree. If other blocks share its size, the first of them takes its
+ * place in the tree.
+ */
+static tree_node_t *tree_remove(tree_node_t *root, tree_node_t *node)
+{
+    assert(root != NULL);
+    size_t size = get_size(&node->block);
 
-    // if the block is the free head we have to move the free heads position
-    bool changeHead = false;
-    if (block == free_head)
+    if (size < get_size(&root->block))
     {
-        changeHead = true;
+        root->left = tree_remove(root->left, node);
+        return tree_balance(root);
+    }
+    if (size > get_size(&root->block))
+    {
+        root->right = tree_remove(root->right, node);
+        return tree_balance(root);
     }
-    allocated_block = block;
-    put_block(allocated_block, size, true);
 
-    // put the allocated block and move the free block to leftover bit of block
-    block += (size / ALIGNMENT) + 1;
-    put_block(block, old_size - (size + ALIGNMENT), false);
-    block->next = store_block;
+    assert(root == node);
+    tree_node_t *replacement = (tree_node_t *)node->block.next;
+    if (replacement)
+    {
+        // the next block of the same size becomes the node
+        replacement->block.prev = NULL;
+        replacement->left = node->left;
+        replacement->right = node->right;
+        replacement->height = node->height;
+        return replacement;
+    }
 
-    // changes the head or the next value depending on position of block in list
-    if (changeHead)
+    if (node->left == NULL)
     {
-        free_head = block;
+        return node->right;
     }
-    else
+    if (node->right == NULL)
     {
-        block_before->next = block;
+        return node->left;
     }
-    allocated_block->next = NULL;
-    return allocated_block;
+
+    // the smallest block larger than node takes its place
+    node->right = tree_remove_min(node->right, &replacement);
+    replacement->left = node->left;
+    replacement->right = node->right;
+    return tree_balance(replacement);
 }
 
 /*
- * coalesce - coalesces a free memory block with neighbors.
+ * tree_find - finds the smallest free block in the tree that holds at least
+ * size bytes.
  */
-memory_block_t *coalesce(memory_block_t *block)
+static memory_block_t *tree_find(size_t size)
 {
+    tree_node_t *best = NULL;
+    tree_node_t *node = arena->tree_root;
 
-    // add connect blocks together if and only if the addresses line up next to each other
-    if (block->next && !is_allocated(block->next) &&
-        block + (get_size(block) / ALIGNMENT) + 1 == block->next)
+    while (node)
     {
-        size_t old_size = get_size(block->next);
+        STAT_VISIT();
+        if (get_size(&node->block) >= size)
+        {
+            best = node;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
 
-        // storing block before put_block NULLs it out
-        memory_block_t *storage_block = block->next->next;
-        put_block(block, ALIGNMENT + old_size + get_size(block), false);
-        block->next = storage_block;
+    if (best == NULL)
+    {
+        return NULL;
     }
 
-    return block;
+    // taking a block from the node's list leaves the tree untouched
+    return best->block.next ? best->block.next : &best->block;
 }
 
 /*
- * uinit - Used initialize metadata required to manage the heap
- * along with allocating initial memory.
+ * mark_bin - notes in the bitmaps that bin holds a free block.
  */
-int uinit()
+static void mark_bin(int bin)
+{
+    arena->bin_map[bin / 64] |= (uint64_t)1 << (bin % 64);
+    arena->bin_summary |= (uint64_t)1 << (bin / 64);
+}
+
+/*
+ * clear_bin - notes in the bitmaps that bin is empty.
+ */
+static void clear_bin(int bin)
+{
+    arena->bin_map[bin / 64] &= ~((uint64_t)1 << (bin % 64));
+    if (arena->bin_map[bin / 64] == 0)
+    {
+        arena->bin_summary &= ~((uint64_t)1 << (bin / 64));
+    }
+}
+
+/*
+ * next_bin - returns the first non-empty bin at or after bin, or -1 if every
+ * one of them is empty.
+ */
+static int next_bin(int bin)
 {
-    // getting the multiplier maximized for coalescing testing case
-    int multiplier = 3;
-    free_head = csbrk((PAGESIZE * multiplier));
-    if (free_head == NULL)
+    if (bin >= NUM_BINS)
     {
         return -1;
     }
 
-    put_block(free_head, ((PAGESIZE * multiplier)) - ALIGNMENT, false);
-    return 0;
+    int word = bin / 64;
+    uint64_t bits = arena->bin_map[word] & (~(uint64_t)0 << (bin % 64));
+    if (bits == 0)
+    {
+        // the summary skips every word with no bins set
+        uint64_t words = arena->bin_summary & (~(uint64_t)1 << word);
+        if (words == 0)
+        {
+            return -1;
+        }
+        word = __builtin_ctzll(words);
+        bits = arena->bin_map[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
 }
 
 /*
- * umalloc -  allocates size bytes and returns a pointer to the allocated memory.
+ * add_free - pushes a free block onto the front of its size-class bin, or into
+ * the size tree if it is large.
  */
-void *umalloc(size_t size)
+void add_free(memory_block_t *block)
 {
-    // Aligning size
-    size = (size % ALIGNMENT == 0) ? size : size + (ALIGNMENT - (size % ALIGNMENT));
+    assert(block != NULL);
+    assert(!is_allocated(block));
+    if (get_size(block) >= TREE_THRESHOLD)
+    {
+        arena->tree_root = tree_insert(arena->tree_root, (tree_node_t *)block);
+        return;
+    }
 
-    // find valid block
-    memory_block_t *free_block = find(size);
+    int bin = get_bin(get_size(block));
+    block->next = arena->free_bins[bin];
+    block->prev = NULL;
+    if (arena->free_bins[bin])
+    {
+        arena->free_bins[bin]->prev = block;
+    }
+    else
+    {
+        mark_bin(bin);
+    }
+    arena->free_bins[bin] = block;
+}
+
+/*
+ * remove_free - unlinks a free block from its size-class bin or the size tree.
+ */
+void remove_free(memory_block_t *block)
+{
+    assert(block != NULL);
+    assert(!is_allocated(block));
+
+#if PLACEMENT == PLACEMENT_NEXT_FIT
+    // the rover of the bin moves on past a block that leaves it
+    if (get_size(block) < TREE_THRESHOLD && arena->bin_rovers[get_bin(get_size(block))] == block)
+    {
+        arena->bin_rovers[get_bin(get_size(block))] = block->next;
+    }
+#endif
 
-    if (free_block)
+    // only the head of the bin or a tree node has no prev
+    if (block->prev)
+    {
+        block->prev->next = block->next;
+    }
+    else if (get_size(block) >= TREE_THRESHOLD)
     {
-        // split block if we have one
-        free_block = split(free_block, size);
+        arena->tree_root = tree_remove(arena->tree_root, (tree_node_t *)block);
+        block->next = NULL;
+        return;
     }
     else
     {
-        // extend heap when out of space
-        free_block = extend(size);
+        int bin = get_bin(get_size(block));
+        assert(arena->free_bins[bin] == block);
+        arena->free_bins[bin] = block->next;
+        if (block->next == NULL)
+        {
+            clear_bin(bin);
+        }
+    }
+    if (block->next)
+    {
+        block->next->prev = block->prev;
+    }
+    block->next = NULL;
+    block->prev = NULL;
+}
+
+/*
+ * put_epilogue - marks the end of a region with an allocated block of size zero
+ * so that looking past the last block never leaves the region.
+ */
+static void put_epilogue(memory_block_t *block)
+{
+    put_block(block, 0, true);
+}
+
+/*
+ * get_next_adjacent - gets the block that physically follows block in memory.
+ */
+memory_block_t *get_next_adjacent(memory_block_t *block)
+{
+    return (memory_block_t *)((char *)get_payload(block) + get_size(block));
+}
+
+/*
+ * get_prev_adjacent - gets the block that physically comes before block in
+ * memory, using its footer. Only valid when that block is free.
+ */
+static memory_block_t *get_prev_adjacent(memory_block_t *block)
+{
+    assert(!is_prev_allocated(block));
+    size_t prev_size = *((size_t *)block - 1);
+    return (memory_block_t *)((char *)block - prev_size - HEADER_SIZE);
+}
 
-        if (free_head == NULL)
+/*
+ * search_bin - finds a block of at least size bytes in a bin by the placement
+ * policy, or returns NULL if none fits.
+ */
+static inline memory_block_t *search_bin(int bin, size_t size)
+{
+#if PLACEMENT == PLACEMENT_FIRST_FIT
+    for (memory_block_t *block = arena->free_bins[bin]; block; block = get_next(block))
+    {
+        STAT_VISIT();
+        if (get_size(block) >= size)
         {
-            // if heap currently empty
-            free_head = free_block;
+            return block;
         }
-        else if (free_head > free_block)
+    }
+    return NULL;
+#elif PLACEMENT == PLACEMENT_NEXT_FIT
+    // the search runs from the rover to the end of the bin, then wraps around
+    memory_block_t *start = arena->bin_rovers[bin] ? arena->bin_rovers[bin] : arena->free_bins[bin];
+    for (memory_block_t *block = start; block; block = get_next(block))
+    {
+        STAT_VISIT();
+        if (get_size(block) >= size)
         {
-            // if block goes in front of head
-            free_block->next = free_head;
-            free_head = free_block;
+            arena->bin_rovers[bin] = get_next(block);
+            return block;
         }
-        else
+    }
+    for (memory_block_t *block = arena->free_bins[bin]; block != start; block = get_next(block))
+    {
+        STAT_VISIT();
+        if (get_size(block) >= size)
+        {
+            arena->bin_rovers[bin] = get_next(block);
+            return block;
+        }
+    }
+    return NULL;
+#else
+    // best fit looks at every block that fits, good fit stops after a few
+    memory_block_t *best = NULL;
+#if PLACEMENT == PLACEMENT_GOOD_FIT
+    size_t candidates = 0;
+#endif
+    for (memory_block_t *block = arena->free_bins[bin]; block; block = get_next(block))
+    {
+        STAT_VISIT();
+        if (get_size(block) < size)
+        {
+            continue;
+        }
+        if (best == NULL || get_size(block) < get_size(best))
         {
-            // add block to right position in the free list
-            memory_block_t *block_position = free_head;
-            while (get_next(block_position) && get_next(block_position) < free_block)
+            best = block;
+            if (get_size(block) == size)
             {
-                block_position = get_next(block_position);
+                break;
             }
-            free_block->next = block_position->next;
-            block_position->next = free_block;
         }
-        // take the space needed to allocate block
-        free_block = split(free_block, size);
+#if PLACEMENT == PLACEMENT_GOOD_FIT
+        if (++candidates == GOOD_FIT_CANDIDATES)
+        {
+            break;
+        }
+#endif
     }
-    // returns payload
-    return free_block + 1;
+    return best;
+#endif
 }
 
 /*
- * ufree -  frees the memory space pointed to by ptr, which must have been called
- * by a previous call to malloc.
+ * get_quick_list - returns the index of the quick list for blocks of the given
+ * payload size.
  */
-void ufree(void *ptr)
+static int get_quick_list(size_t size)
 {
-    memory_block_t *free_block = get_block(ptr);
+    assert(size <= QUICK_MAX_SIZE);
+    return (size + HEADER_SIZE) / ALIGNMENT - 1;
+}
 
-    // only free if allocated already
-    if (is_allocated(free_block))
+/*
+ * free_mark - returns the second word of a payload, which holds the payload's
+ * address XOR FREE_MAGIC while it waits to be freed for real.
+ */
+static uintptr_t *free_mark(void *ptr)
+{
+    return (uintptr_t *)ptr + 1;
+}
+
+/*
+ * has_free_mark - returns true if the second word of a payload holds its
+ * free mark, which data can also happen to hold.
+ */
+static bool has_free_mark(void *ptr)
+{
+    return *free_mark(ptr) == ((uintptr_t)ptr ^ FREE_MAGIC);
+}
+
+/*
+ * is_quick - returns true if an allocated block is on a quick list of the
+ * calling thread's arena. Only a block with the mark is looked for on its
+ * list, so the answer is exact even if the mark was just data that happened
+ * to match.
+ */
+bool is_quick(memory_block_t *block)
+{
+    size_t size = get_size(block);
+    if (size > QUICK_MAX_SIZE || !has_free_mark(get_payload(block)))
     {
-        deallocate(free_block);
+        return false;
+    }
+    memory_block_t *cur = arena->quick_lists[get_quick_list(size)];
+    while (cur && cur != block)
+    {
+        cur = *(memory_block_t **)get_payload(cur);
+    }
+    return cur == block;
+}
 
-        // add back to free list
-        if (free_head == NULL)
-        {
-            // add to head if head empty
-            free_head = free_block;
-        }
-        else if (free_head > free_block)
+/*
+ * quick_push - puts an allocated block that is being freed on the quick list
+ * for its size, without coalescing it.
+ */
+static void quick_push(memory_block_t *block)
+{
+    int list = get_quick_list(get_size(block));
+    *(memory_block_t **)get_payload(block) = arena->quick_lists[list];
+    *free_mark(get_payload(block)) = (uintptr_t)get_payload(block) ^ FREE_MAGIC;
+    arena->quick_lists[list] = block;
+    arena->quick_bytes += get_size(block);
+    log_dirty(block);
+}
+
+/*
+ * quick_pop - takes the most recently freed block of exactly size bytes off its
+ * quick list, or returns NULL if there is none.
+ */
+static memory_block_t *quick_pop(size_t size)
+{
+    int list = get_quick_list(size);
+    memory_block_t *block = arena->quick_lists[list];
+    if (block)
+    {
+        arena->quick_lists[list] = *(memory_block_t **)get_payload(block);
+        *free_mark(get_payload(block)) = 0;
+        arena->quick_bytes -= size;
+        log_dirty(block);
+    }
+    return block;
+}
+
+/*
+ * consolidate - frees every block on the quick lists for real, coalescing each
+ * with its free neighbors and binning it.
+ */
+void consolidate()
+{
+    for (int list = 0; list < QUICK_LISTS; list++)
+    {
+        memory_block_t *block = arena->quick_lists[list];
+        arena->quick_lists[list] = NULL;
+        while (block)
+        {
+            memory_block_t *next = *(memory_block_t **)get_payload(block);
+            *free_mark(get_payload(block)) = 0;
+            deallocate(block);
+            add_free(coalesce(block));
+            block = next;
+        }
+    }
+    arena->quick_bytes = 0;
+}
+
+/*
+ * find_fit - finds a binned free block or large free block that can hold size
+ * bytes.
+ */
+static memory_block_t *find_fit(size_t size)
+{
+    // large requests can only be served by the size tree
+    if (size >= TREE_THRESHOLD)
+    {
+        return tree_find(size);
+    }
+
+    // the bin of the request may hold blocks that are too small
+    int bin = get_bin(size);
+    memory_block_t *find_block = search_bin(bin, size);
+    if (find_block)
+    {
+        return find_block;
+    }
+
+    // every block in a larger bin fits, so the first non-empty bin is used
+    bin = next_bin(bin + 1);
+    if (bin >= 0)
+    {
+        return search_bin(bin, size);
+    }
+
+    // otherwise the smallest large block is split
+    return tree_find(size);
+}
+
+/*
+ * find - finds a free block that can satisfy the umalloc request, giving the
+ * blocks on the quick lists back to the bins if nothing fits otherwise.
+ */
+memory_block_t *find(size_t size)
+{
+#ifdef UMALLOC_STATS
+    find_visits[arena - arenas] = 0;
+#endif
+    STAT_INC(find_calls);
+
+    memory_block_t *find_block = find_fit(size);
+    if (find_block == NULL && arena->quick_bytes > 0)
+    {
+        consolidate();
+        find_block = find_fit(size);
+    }
+
+#ifdef UMALLOC_STATS
+    // the search length goes into the bucket of its highest set bit
+    size_t visits = find_visits[arena - arenas];
+    int bucket = visits ? 64 - __builtin_clzl(visits) : 0;
+    arena_stats[arena - arenas].search_lengths[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+#endif
+    return find_block;
+}
+
+/*
+ * page_slot - returns the page map entry of the page addr is on. The nodes on
+ * the way to it are mapped if create is set, otherwise NULL is returned when
+ * they are missing, as it is when mmap fails or addr is above what the map
+ * covers.
+ */
+static THREAD_SHARED uintptr_t *page_slot(void *addr, bool create)
+{
+    size_t page = (size_t)addr >> PAGE_SHIFT;
+    // higher bits would wrap onto the slot of a lower page
+    if (page >> (PAGE_MAP_LEVELS * PAGE_MAP_BITS) != 0)
+    {
+        return NULL;
+    }
+    THREAD_SHARED uintptr_t *node = page_map;
+    for (int level = PAGE_MAP_LEVELS - 1; level > 0; level--)
+    {
+        THREAD_SHARED uintptr_t *slot = &node[(page >> (level * PAGE_MAP_BITS)) & (PAGE_MAP_SIZE - 1)];
+        if (*slot == 0)
+        {
+            if (!create)
+            {
+                return NULL;
+            }
+            void *child = mmap(NULL, PAGE_MAP_SIZE * sizeof(uintptr_t), PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (child == MAP_FAILED)
+            {
+                return NULL;
+            }
+#ifdef UMALLOC_THREADS
+            // another thread may have put a node here first
+            uintptr_t empty = 0;
+            if (!atomic_compare_exchange_strong(slot, &empty, (uintptr_t)child))
+            {
+                munmap(child, PAGE_MAP_SIZE * sizeof(uintptr_t));
+            }
+#else
+            *slot = (uintptr_t)child;
+#endif
+        }
+        node = (THREAD_SHARED uintptr_t *)*slot;
+    }
+    return &node[page & (PAGE_MAP_SIZE - 1)];
+}
+
+/*
+ * page_lookup - returns the page map entry of the page addr is on, which is
+ * zero if the allocator does not own it.
+ */
+static uintptr_t page_lookup(void *addr)
+{
+    THREAD_SHARED uintptr_t *slot = page_slot(addr, false);
+    return slot ? *slot : 0;
+}
+
+/*
+ * page_kind - returns what kind of owner a page map entry names.
+ */
+static page_kind_t page_kind(uintptr_t entry)
+{
+    return entry & PAGE_KIND_MASK;
+}
+
+/*
+ * page_owner - returns the region_t, slab_t or block header a page map entry
+ * names.
+ */
+static void *page_owner(uintptr_t entry)
+{
+    return (void *)(entry & ~(uintptr_t)PAGE_KIND_MASK);
+}
+
+/*
+ * page_map_set - sets the entries of every page that [start, end) touches to
+ * owner tagged with kind, or clears them for PAGE_NONE. Returns false if the
+ * page map could not grow to hold them.
+ */
+static bool page_map_set(void *start, void *end, void *owner, page_kind_t kind)
+{
+    assert(((uintptr_t)owner & PAGE_KIND_MASK) == 0);
+    uintptr_t entry = (kind == PAGE_NONE) ? 0 : (uintptr_t)owner | kind;
+    for (char *page = (char *)((size_t)start & ~(size_t)(PAGESIZE - 1)); page < (char *)end; page += PAGESIZE)
+    {
+        THREAD_SHARED uintptr_t *slot = page_slot(page, kind != PAGE_NONE);
+        if (slot == NULL)
+        {
+            if (kind != PAGE_NONE)
+            {
+                return false;
+            }
+            continue;
+        }
+        *slot = entry;
+    }
+    return true;
+}
+
+/*
+ * page_map_free - gives back every node below a page map node at the given
+ * level, leaving the node empty.
+ */
+static void page_map_free(THREAD_SHARED uintptr_t *node, int level)
+{
+    for (int i = 0; i < PAGE_MAP_SIZE; i++)
+    {
+        if (level > 0 && node[i])
+        {
+            THREAD_SHARED uintptr_t *child = (THREAD_SHARED uintptr_t *)node[i];
+            page_map_free(child, level - 1);
+            munmap((void *)child, PAGE_MAP_SIZE * sizeof(uintptr_t));
+        }
+        node[i] = 0;
+    }
+}
+
+/*
+ * sbrk_lock - keeps threads of other arenas from moving the break until
+ * sbrk_unlock, if the allocator is built for threads.
+ */
+static void sbrk_lock()
+{
+#ifdef UMALLOC_THREADS
+    pthread_mutex_lock(&sbrk_mutex);
+#endif
+}
+
+/*
+ * sbrk_unlock - lets other threads move the break again.
+ */
+static void sbrk_unlock()
+{
+#ifdef UMALLOC_THREADS
+    pthread_mutex_unlock(&sbrk_mutex);
+#endif
+}
+
+/*
+ * heap_sbrk - moves the break by increment bytes through csbrk, counting the
+ * call and the bytes asked for. The caller must hold the sbrk lock.
+ */
+static void *heap_sbrk(intptr_t increment)
+{
+    csbrk_calls++;
+    if (increment > 0)
+    {
+        csbrk_bytes += increment;
+    }
+    return csbrk(increment);
+}
+
+/*
+ * heap_top - returns the epilogue of the newest region, the only place the
+ * heap can grow in place, or NULL if the arena has no regions yet.
+ */
+static memory_block_t *heap_top()
+{
+    return arena->regions ? arena->regions->epilogue : NULL;
+}
+
+/*
+ * add_chunk - turns memory from csbrk into a free block followed by an
+ * epilogue, either at the end of the newest region if the chunk continues it
+ * or as a new region. Returns NULL if the chunk is too small to hold a block.
+ */
+static memory_block_t *add_chunk(void *chunk, size_t chunk_size)
+{
+    region_t *region = arena->regions;
+    memory_block_t *extra_block;
+
+    if (region && (char *)chunk == (char *)region->epilogue + HEADER_SIZE)
+    {
+        // the chunk continues the region, so its epilogue becomes the header
+        if (chunk_size < HEADER_SIZE + MIN_BLOCK_SIZE)
+        {
+            return NULL;
+        }
+        if (!page_map_set(chunk, (char *)chunk + chunk_size, region, PAGE_HEAP))
+        {
+            return NULL;
+        }
+        bool prev_alloc = is_prev_allocated(region->epilogue);
+        extra_block = region->epilogue;
+        put_block(extra_block, chunk_size - HEADER_SIZE, false);
+        set_prev_allocated(extra_block, prev_alloc);
+    }
+    else
+    {
+        if (chunk_size < REGION_OVERHEAD + MIN_BLOCK_SIZE)
+        {
+            return NULL;
+        }
+
+        // a region that ends on the first page of this one stays reachable
+        uintptr_t entry = page_lookup(chunk);
+        region = chunk;
+        region->below = (page_kind(entry) == PAGE_HEAP) ? page_owner(entry) : NULL;
+        region->arena = arena;
+
+        // threads of other arenas follow below and arena without a lock, so
+        // they are set before the page map leads anyone here
+        if (!page_map_set(chunk, (char *)chunk + chunk_size, chunk, PAGE_HEAP))
+        {
+            return NULL;
+        }
+
+        // the region itself comes first, and nothing comes before its prologue
+        region->next = arena->regions;
+        arena->regions = region;
+        memory_block_t *prologue = (memory_block_t *)(region + 1);
+        put_block(prologue, 0, true);
+        set_prev_allocated(prologue, true);
+
+        extra_block = get_next_adjacent(prologue);
+        put_block(extra_block, chunk_size - REGION_OVERHEAD, false);
+        set_prev_allocated(extra_block, true);
+    }
+    SHARED_STORE(region->epilogue, get_next_adjacent(extra_block));
+    put_epilogue(region->epilogue);
+
+    // merge with a free block that ended the region
+    return coalesce(extra_block);
+}
+
+/*
+ * grow_size - picks how many bytes the heap grows by when it needs at least
+ * need more, given whether the new chunk continues the newest region, and
+ * records the miss in the arena's growth history.
+ */
+static size_t grow_size(size_t need, bool contiguous)
+{
+    // the tail of a region that other users of the break cut off is wasted,
+    // so growth only speeds up while the heap stays contiguous
+    if (!contiguous)
+    {
+        arena->grow_next = GROW_MIN;
+    }
+
+    arena->miss_average = (arena->miss_average * (GROW_HISTORY - 1) + need) / GROW_HISTORY;
+
+    size_t chunk_size = arena->grow_next;
+    if (chunk_size < GROW_AHEAD * arena->miss_average)
+    {
+        chunk_size = ALIGN(GROW_AHEAD * arena->miss_average);
+    }
+    if (chunk_size > GROW_MAX)
+    {
+        chunk_size = GROW_MAX;
+    }
+    if (chunk_size < need)
+    {
+        chunk_size = need;
+    }
+
+    arena->grow_next = (2 * arena->grow_next < GROW_MAX) ? 2 * arena->grow_next : GROW_MAX;
+    return chunk_size;
+}
+
+/*
+ * extend - extends the heap if more memory is required.
+ */
+memory_block_t *extend(size_t size)
+{
+    STAT_INC(extend_calls);
+    sbrk_lock();
+
+    // a new region needs room for its prologue, header and epilogue, while a
+    // chunk that continues the newest one only needs a header. A free block at
+    // its top is merged with the chunk, but is not counted against it, as
+    // blocks that keep growing soon need the space anyway
+    size_t need = size + REGION_OVERHEAD;
+    memory_block_t *epilogue = heap_top();
+    bool contiguous = epilogue && sbrk(0) == (char *)epilogue + HEADER_SIZE;
+    if (contiguous)
+    {
+        need = size + HEADER_SIZE;
+    }
+
+    size_t chunk_size = grow_size(need, contiguous);
+    void *chunk = heap_sbrk(chunk_size);
+    sbrk_unlock();
+
+    // if nothing given by csbrk return NULL
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+
+    return add_chunk(chunk, chunk_size);
+}
+
+/*
+ * perfectFit - returns the block after removing it from the free list
+ */
+memory_block_t *perfectFit(memory_block_t *block, size_t size)
+{
+    remove_free(block);
+    allocate(block);
+    set_prev_allocated(get_next_adjacent(block), true);
+    return block;
+}
+
+/*
+ * split - splits a given block in parts, one allocated, one free.
+ */
+memory_block_t *split(memory_block_t *block, size_t size)
+{
+    // only occurs after malloc calls
+    STAT_INC(split_calls);
+    size_t old_size = get_size(block);
+
+    // allocates the entire free block if the leftover would be too small to use
+    if (old_size - size <= HEADER_SIZE + ALIGNMENT)
+    {
+        return perfectFit(block, old_size);
+    }
+
+    STAT_INC(splits);
+    remove_free(block);
+    memory_block_t *allocated_block = block;
+    bool prev_alloc = is_prev_allocated(block);
+    put_block(allocated_block, size, true);
+    set_prev_allocated(allocated_block, prev_alloc);
+
+    // move the free block to leftover bit of block and bin it by its new size,
+    // the block after it already knows its neighbor is free
+    block = get_next_adjacent(allocated_block);
+    put_block(block, old_size - (size + HEADER_SIZE), false);
+    set_prev_allocated(block, true);
+    add_free(block);
+
+    return allocated_block;
+}
+
+/*
+ * trim_block - gives the part of an allocated block past size back to the heap,
+ * if it is large enough to be a block of its own.
+ */
+static void trim_block(memory_block_t *block, size_t size)
+{
+    size_t old_size = get_size(block);
+    if (old_size <= size || old_size - size <= HEADER_SIZE + ALIGNMENT)
+    {
+        return;
+    }
+
+    bool prev_alloc = is_prev_allocated(block);
+    put_block(block, size, true);
+    set_prev_allocated(block, prev_alloc);
+
+    // the tail may border a free block, which it is merged with
+    memory_block_t *tail = get_next_adjacent(block);
+    put_block(tail, old_size - (size + HEADER_SIZE), false);
+    set_prev_allocated(tail, true);
+    add_free(coalesce(tail));
+}
+
+/*
+ * coalesce - coalesces a free memory block with neighbors. The block must not
+ * be in a bin yet, since its size may change.
+ */
+memory_block_t *coalesce(memory_block_t *block)
+{
+    STAT_INC(coalesce_calls);
+    size_t size = get_size(block);
+    bool prev_alloc = is_prev_allocated(block);
+    memory_block_t *next_block = get_next_adjacent(block);
+
+    // the epilogue is always allocated, so this never leaves the region
+    if (!is_allocated(next_block))
+    {
+        remove_free(next_block);
+        size += HEADER_SIZE + get_size(next_block);
+    }
+
+    // the first block of a region follows the prologue, which is allocated
+    if (!prev_alloc)
+    {
+        block = get_prev_adjacent(block);
+        remove_free(block);
+        prev_alloc = is_prev_allocated(block);
+        size += HEADER_SIZE + get_size(block);
+    }
+
+    // merging with either neighbor changes the size of the block kept
+    if (size != get_size(block))
+    {
+        STAT_INC(merges);
+    }
+    put_block(block, size, false);
+    set_prev_allocated(block, prev_alloc);
+    set_prev_allocated(get_next_adjacent(block), false);
+    return block;
+}
+
+/*
+ * get_slab - given a payload, returns the slab it was carved from, or NULL if
+ * it belongs to a heap block.
+ */
+slab_t *get_slab(void *payload)
+{
+    assert(payload != NULL);
+    uintptr_t entry = page_lookup(payload);
+    return (page_kind(entry) == PAGE_SLAB) ? page_owner(entry) : NULL;
+}
+
+/*
+ * entry_region - returns the heap region that addr lies in, given the page map
+ * entry of its page, or NULL if it is not in one.
+ */
+static region_t *entry_region(void *addr, uintptr_t entry)
+{
+    if (page_kind(entry) != PAGE_HEAP)
+    {
+        return NULL;
+    }
+
+    // the regions sharing a page are linked latest first
+    region_t *region = page_owner(entry);
+    while (region && (char *)addr < (char *)region)
+    {
+        region = region->below;
+    }
+    if (region == NULL || (char *)addr >= (char *)SHARED_LOAD(region->epilogue) + HEADER_SIZE)
+    {
+        return NULL;
+    }
+    return region;
+}
+
+/*
+ * get_region - returns the heap region that addr lies in, or NULL if it is not
+ * in one.
+ */
+region_t *get_region(void *addr)
+{
+    return entry_region(addr, page_lookup(addr));
+}
+
+/*
+ * heap_walk_start - sets up a walk over every heap block.
+ */
+void heap_walk_start(heap_walk_t *walk)
+{
+    walk->arena = 0;
+    walk->region = NULL;
+    walk->block = NULL;
+}
+
+/*
+ * heap_walk_next - moves a walk on to the next heap block and returns it, or
+ * returns NULL once every region of every arena was walked. A block that
+ * reaches past the epilogue of its region ends the region.
+ */
+memory_block_t *heap_walk_next(heap_walk_t *walk)
+{
+    memory_block_t *block = walk->block ? get_next_adjacent(walk->block) : NULL;
+    while (block == NULL || block >= walk->region->epilogue)
+    {
+        // the region is done, so the walk goes on with the next one
+        walk->region = walk->region ? walk->region->next : NULL;
+        while (walk->region == NULL)
+        {
+            if (walk->arena == NUM_ARENAS)
+            {
+                walk->block = NULL;
+                return NULL;
+            }
+            walk->region = arenas[walk->arena++].regions;
+        }
+        block = get_next_adjacent((memory_block_t *)(walk->region + 1));
+    }
+    walk->block = block;
+    return block;
+}
+
+/*
+ * slot_bit - returns the bit of a slab's in_use map for the slot at slot.
+ */
+static size_t slot_bit(slab_t *slab, void *slot)
+{
+    return ((char *)slot - (char *)slab) / ALIGNMENT;
+}
+
+/*
+ * slot_in_use - returns true if slot was handed out by its slab and has not
+ * been freed since.
+ */
+bool slot_in_use(slab_t *slab, void *slot)
+{
+    size_t bit = slot_bit(slab, slot);
+    return (SHARED_LOAD(slab->in_use[bit / 64]) >> (bit % 64)) & 1;
+}
+
+/*
+ * looks_allocated - returns true if ptr, whose page has the given page map
+ * entry, is the start of a slot its slab marks in use, the payload of a block
+ * with a mapping of its own, or the payload of an allocated block inside a
+ * heap region. Foreign and interior pointers fail this. It only reads words
+ * that are set before the page map leads to them or that are loaded whole, so
+ * threads of other arenas may call it without the lock of the arena ptr
+ * belongs to; the answer is only stale if ptr is being freed meanwhile, which
+ * a correct caller never does.
+ */
+static bool looks_allocated(void *ptr, uintptr_t entry)
+{
+    switch (page_kind(entry))
+    {
+    case PAGE_SLAB:
+        // only the first byte of a slot in use has its bit set
+        return (size_t)ptr % ALIGNMENT == 0 && slot_in_use(page_owner(entry), ptr);
+    case PAGE_MAPPED:
+        return ptr == get_payload(page_owner(entry));
+    case PAGE_HEAP:
+    {
+        region_t *region = entry_region(ptr, entry);
+        if (region == NULL || (size_t)ptr % ALIGNMENT != 0)
+        {
+            return false;
+        }
+        memory_block_t *block = get_block(ptr);
+        memory_block_t *epilogue = SHARED_LOAD(region->epilogue);
+        return block > (memory_block_t *)(region + 1) && block < epilogue && is_allocated(block) &&
+               !is_mmapped(block) && get_next_adjacent(block) <= epilogue;
+    }
+    default:
+        return false;
+    }
+}
+
+/*
+ * is_valid_payload - returns true if ptr, whose page has the given page map
+ * entry, could have been returned by umalloc and not freed since: it looks
+ * allocated and, for a heap block, is not on a quick list either. Allocations
+ * waiting in a thread cache still pass, tcache_free looks for those itself.
+ * The caller must hold the lock of the arena ptr belongs to, and be bound to
+ * it.
+ */
+static bool is_valid_payload(void *ptr, uintptr_t entry)
+{
+    return looks_allocated(ptr, entry) && (page_kind(entry) != PAGE_HEAP || !is_quick(get_block(ptr)));
+}
+
+/*
+ * slab_is_full - returns true if every slot of the slab is handed out.
+ */
+static bool slab_is_full(slab_t *slab)
+{
+    return slab->free_slots == NULL &&
+           slab->unused + slab->slot_size > (char *)slab + PAGESIZE;
+}
+
+/*
+ * slab_unlink - removes a slab from the list of slabs with free slots.
+ */
+static void slab_unlink(slab_t *slab, int slab_class)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        arena->slab_partial[slab_class] = slab->next;
+    }
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/*
+ * slab_link - adds a slab to the front of the list of slabs with free slots.
+ */
+static void slab_link(slab_t *slab, int slab_class)
+{
+    slab->prev = NULL;
+    slab->next = arena->slab_partial[slab_class];
+    if (slab->next)
+    {
+        slab->next->prev = slab;
+    }
+    arena->slab_partial[slab_class] = slab;
+}
+
+/*
+ * slab_new - sets up a page for the given size class, reusing an empty slab if
+ * there is one. New slabs get an anonymous mapping of their own, so they do
+ * not cut the heap into regions, and utrim can unmap them once they are empty.
+ */
+static slab_t *slab_new(int slab_class)
+{
+    slab_t *slab = arena->slab_empty;
+
+    if (slab)
+    {
+        arena->slab_empty = slab->next;
+    }
+    else
+    {
+        slab = mmap(NULL, PAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+        {
+            return NULL;
+        }
+        mmap_bytes += PAGESIZE;
+
+        // like a region, a slab is set up before the page map leads to it; the
+        // rest of a fresh mapping, its bitmap included, reads as zero
+        slab->arena = arena;
+        if (!page_map_set(slab, (char *)slab + PAGESIZE, slab, PAGE_SLAB))
+        {
+            munmap(slab, PAGESIZE);
+            mmap_bytes -= PAGESIZE;
+            return NULL;
+        }
+    }
+
+    slab->free_slots = NULL;
+    slab->unused = (char *)slab + SLAB_HEADER_SIZE;
+    slab->slot_size = (slab_class + 1) * ALIGNMENT;
+    slab->used = 0;
+    slab_link(slab, slab_class);
+    return slab;
+}
+
+/*
+ * slab_alloc - hands out a slot of at least size bytes.
+ */
+static void *slab_alloc(size_t size)
+{
+    int slab_class = (size < ALIGNMENT) ? 0 : ALIGN(size) / ALIGNMENT - 1;
+    slab_t *slab = arena->slab_partial[slab_class];
+
+    if (slab == NULL)
+    {
+        slab = slab_new(slab_class);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    // recently freed slots first, then slots that were never used
+    void *slot = slab->free_slots;
+    if (slot)
+    {
+        slab->free_slots = *(void **)slot;
+    }
+    else
+    {
+        slot = slab->unused;
+        slab->unused += slab->slot_size;
+    }
+    slab->used++;
+    size_t bit = slot_bit(slab, slot);
+    SHARED_STORE(slab->in_use[bit / 64], SHARED_LOAD(slab->in_use[bit / 64]) | (uint64_t)1 << (bit % 64));
+    log_slab(slab);
+
+    if (slab_is_full(slab))
+    {
+        slab_unlink(slab, slab_class);
+    }
+    return slot;
+}
+
+/*
+ * slab_free - gives a slot back to its slab. Slabs left with no slots in use
+ * become empty slabs that any size class can take. A slot that is already
+ * free is left alone, so freeing it twice cannot make the slab look empty
+ * while other slots are still in use.
+ */
+static void slab_free(slab_t *slab, void *slot)
+{
+    int slab_class = slab->slot_size / ALIGNMENT - 1;
+
+    if (!slot_in_use(slab, slot))
+    {
+        return;
+    }
+    size_t bit = slot_bit(slab, slot);
+    SHARED_STORE(slab->in_use[bit / 64], SHARED_LOAD(slab->in_use[bit / 64]) & ~((uint64_t)1 << (bit % 64)));
+    assert(slab->used > 0);
+    log_slab(slab);
+
+    if (slab_is_full(slab))
+    {
+        slab_link(slab, slab_class);
+    }
+    *(void **)slot = slab->free_slots;
+    slab->free_slots = slot;
+    slab->used--;
+
+    if (slab->used == 0)
+    {
+        slab_unlink(slab, slab_class);
+        slab->next = arena->slab_empty;
+        arena->slab_empty = slab;
+    }
+}
+
+/*
+ * arena_init - empties the slabs and free structures of an arena.
+ */
+static void arena_init(arena_t *init)
+{
+    for (int bin = 0; bin < NUM_BINS; bin++)
+    {
+        init->free_bins[bin] = NULL;
+        init->bin_rovers[bin] = NULL;
+    }
+    for (int list = 0; list < QUICK_LISTS; list++)
+    {
+        init->quick_lists[list] = NULL;
+    }
+    init->quick_bytes = 0;
+    for (int word = 0; word < BIN_WORDS; word++)
+    {
+        init->bin_map[word] = 0;
+    }
+    init->bin_summary = 0;
+    init->tree_root = NULL;
+    for (int slab_class = 0; slab_class < SLAB_CLASSES; slab_class++)
+    {
+        init->slab_partial[slab_class] = NULL;
+    }
+    init->slab_empty = NULL;
+    init->regions = NULL;
+    init->grow_next = GROW_MIN;
+    init->miss_average = 0;
+#ifdef UMALLOC_CHECK
+    init->dirty_count = 0;
+    init->dirty_slab_count = 0;
+#endif
+#ifdef UMALLOC_THREADS
+    pthread_mutex_init(&init->lock, NULL);
+    atomic_store(&init->remote_frees, NULL);
+#endif
+}
+
+/*
+ * uinit - Used initialize metadata required to manage the heap
+ * along with allocating initial memory.
+ */
+int uinit()
+{
+    for (int i = 0; i < NUM_ARENAS; i++)
+    {
+        arena_init(&arenas[i]);
+    }
+    page_map_free(page_map, PAGE_MAP_LEVELS - 1);
+#ifdef UMALLOC_STATS
+    memset(arena_stats, 0, sizeof(arena_stats));
+#endif
+    mmap_bytes = 0;
+    csbrk_calls = 0;
+    csbrk_bytes = 0;
+    if (!mmap_threshold_fixed)
+    {
+        mmap_threshold = MMAP_THRESHOLD;
+    }
+#ifdef UMALLOC_THREADS
+    // the calling thread takes the first arena, which gets the first chunk
+    arena = &arenas[0];
+    atomic_store(&next_arena, 1);
+
+    // cached blocks belonged to the old heap
+    for (int tcache_class = 0; tcache_class < TCACHE_CLASSES; tcache_class++)
+    {
+        tcache[tcache_class].head = NULL;
+        tcache[tcache_class].count = 0;
+    }
+#endif
+
+    // the heap gets its first region from the first request that needs it
+    return 0;
+}
+
+/*
+ * map_block - gives a request of size bytes an anonymous mapping of its own,
+ * with the payload aligned to alignment. Returns NULL if mmap fails.
+ */
+static memory_block_t *map_block(size_t size, size_t alignment)
+{
+    // the payload is aligned to ALIGNMENT right after the header rounded up,
+    // larger alignments need room to move it
+    size_t slack = (alignment > ALIGNMENT) ? alignment : 0;
+    size_t length = PAGE_ALIGN(ALIGN(HEADER_SIZE) + size + slack);
+    char *start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED)
+    {
+        return NULL;
+    }
+    char *end = start + length;
+
+    char *payload = start + ALIGN(HEADER_SIZE);
+    if (slack)
+    {
+        // the whole pages around the aligned block are given back
+        payload = (char *)(((size_t)payload + alignment - 1) & ~(alignment - 1));
+        char *block_start = (char *)((size_t)(payload - HEADER_SIZE) & ~(size_t)(PAGESIZE - 1));
+        char *block_end = (char *)PAGE_ALIGN((size_t)(payload + size));
+        if (block_start > start)
+        {
+            munmap(start, block_start - start);
+        }
+        if (block_end < end)
+        {
+            munmap(block_end, end - block_end);
+        }
+        start = block_start;
+        end = block_end;
+    }
+
+    // the payload runs to the end of the mapping, so unlike a heap block the
+    // header and payload need not add up to a multiple of ALIGNMENT
+    memory_block_t *block = get_block(payload);
+    if (!page_map_set(start, end, block, PAGE_MAPPED))
+    {
+        munmap(start, end - start);
+        return NULL;
+    }
+    SHARED_STORE(block->block_metadata, (end - payload) | 0x4 | 0x1);
+    set_prev_allocated(block, true);
+    mmap_bytes += end - start;
+    return block;
+}
+
+/*
+ * get_mapping - gets the start of the mapping of a block with one of its own.
+ */
+static char *get_mapping(memory_block_t *block)
+{
+    return (char *)((size_t)block & ~(size_t)(PAGESIZE - 1));
+}
+
+/*
+ * unmap_block - gives the mapping of a block back to the OS, and raises the
+ * mmap threshold past the block's size if that is still allowed.
+ */
+static void unmap_block(memory_block_t *block)
+{
+    size_t size = get_size(block);
+    char *start = get_mapping(block);
+    size_t length = (char *)get_payload(block) + size - start;
+
+    if (!mmap_threshold_fixed && size > mmap_threshold && size <= MMAP_THRESHOLD_MAX)
+    {
+        mmap_threshold = size;
+    }
+    mmap_bytes -= length;
+    page_map_set(start, start + length, NULL, PAGE_NONE);
+    munmap(start, length);
+}
+
+/*
+ * remap_block - resizes the mapping of a block to hold size bytes, moving it
+ * if it cannot grow where it is. Returns NULL if mremap fails.
+ */
+static memory_block_t *remap_block(memory_block_t *block, size_t size)
+{
+    char *start = get_mapping(block);
+    size_t offset = (char *)get_payload(block) - start;
+    size_t old_length = offset + get_size(block);
+    size_t length = PAGE_ALIGN(offset + size);
+
+    if (length <= old_length)
+    {
+        // the pages past the new end leave the page map before they are unmapped
+        page_map_set(start + length, start + old_length, NULL, PAGE_NONE);
+        if (mremap(start, old_length, length, 0) == MAP_FAILED)
+        {
+            page_map_set(start + length, start + old_length, block, PAGE_MAPPED);
+            return NULL;
+        }
+        mmap_bytes -= old_length - length;
+    }
+    else if (mremap(start, old_length, length, 0) != MAP_FAILED)
+    {
+        if (!page_map_set(start + old_length, start + length, block, PAGE_MAPPED))
+        {
+            mremap(start, length, old_length, 0);
+            return NULL;
+        }
+        mmap_bytes += length - old_length;
+    }
+    else
+    {
+        // the block moves to pages that are in the page map before it gets
+        // there, and its old pages leave the map before another thread can
+        // map them again
+        char *new_start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (new_start == MAP_FAILED)
+        {
+            return NULL;
+        }
+        if (!page_map_set(new_start, new_start + length, new_start + offset - HEADER_SIZE, PAGE_MAPPED))
+        {
+            munmap(new_start, length);
+            return NULL;
+        }
+        page_map_set(start, start + old_length, NULL, PAGE_NONE);
+        if (mremap(start, old_length, length, MREMAP_MAYMOVE | MREMAP_FIXED, new_start) == MAP_FAILED)
+        {
+            page_map_set(start, start + old_length, block, PAGE_MAPPED);
+            page_map_set(new_start, new_start + length, NULL, PAGE_NONE);
+            munmap(new_start, length);
+            return NULL;
+        }
+        mmap_bytes += length - old_length;
+        start = new_start;
+    }
+
+    // the page offset of the block stays the same, only its size changes
+    block = get_block(start + offset);
+    SHARED_STORE(block->block_metadata, (length - offset) | (SHARED_LOAD(block->block_metadata) & 0x7));
+    return block;
+}
+
+/*
+ * release_pages - gives the whole pages inside a free block back to the OS,
+ * keeping the links at its start and the footer at its end. The pages read as
+ * zero once they are touched again. Returns true if there were any.
+ */
+static bool release_pages(memory_block_t *block)
+{
+    char *start = (char *)PAGE_ALIGN((size_t)block + sizeof(tree_node_t));
+    char *end = (char *)((size_t)get_footer(block) & ~(size_t)(PAGESIZE - 1));
+    if (start >= end)
+    {
+        return false;
+    }
+    madvise(start, end - start, MADV_DONTNEED);
+    return true;
+}
+
+/*
+ * trim_top - lowers the break until the free block at the top of the heap
+ * keeps pad bytes, rounded up to the end of their page. This only works when
+ * nothing else moved the break since the heap last grew. Returns true if
+ * memory was given back.
+ */
+static bool trim_top(size_t pad)
+{
+    memory_block_t *epilogue = heap_top();
+    if (epilogue == NULL || is_prev_allocated(epilogue))
+    {
+        return false;
+    }
+    memory_block_t *top = get_prev_adjacent(epilogue);
+
+    // the new break is kept on a page boundary, so memory the heap gets back
+    // later is whole fresh pages
+    size_t keep = (pad < ALIGNMENT) ? ALIGNMENT : ALIGN(pad);
+    char *new_brk = (char *)PAGE_ALIGN((size_t)get_payload(top) + keep + HEADER_SIZE);
+
+    sbrk_lock();
+    char *brk = sbrk(0);
+    if (brk != (char *)epilogue + HEADER_SIZE || new_brk >= brk ||
+        heap_sbrk(-(intptr_t)(brk - new_brk)) == NULL || sbrk(0) != new_brk)
+    {
+        sbrk_unlock();
+        return false;
+    }
+    page_map_set(new_brk, brk, NULL, PAGE_NONE);
+    sbrk_unlock();
+
+    remove_free(top);
+    bool prev_alloc = is_prev_allocated(top);
+    put_block(top, new_brk - HEADER_SIZE - (char *)get_payload(top), false);
+    set_prev_allocated(top, prev_alloc);
+    SHARED_STORE(arena->regions->epilogue, get_next_adjacent(top));
+    put_epilogue(arena->regions->epilogue);
+    add_free(top);
+    return true;
+}
+
+/*
+ * release_tree - releases the pages inside every block of a subtree of the
+ * size tree, returning true if there were any.
+ */
+static bool release_tree(tree_node_t *node)
+{
+    bool released = false;
+    while (node)
+    {
+        for (memory_block_t *block = &node->block; block; block = block->next)
+        {
+            released |= release_pages(block);
+        }
+        released |= release_tree(node->left);
+        node = node->right;
+    }
+    return released;
+}
+
+/*
+ * add_released - bins a free block that was just coalesced, and gives its
+ * memory back to the OS if it is large enough.
+ */
+static void add_released(memory_block_t *free_block)
+{
+    add_free(free_block);
+
+    size_t size = get_size(free_block);
+    if (size >= TRIM_THRESHOLD && get_next_adjacent(free_block) == heap_top())
+    {
+        trim_top(TRIM_PAD);
+    }
+    else if (size >= DONTNEED_THRESHOLD)
+    {
+        release_pages(free_block);
+    }
+}
+
+/*
+ * heap_malloc - allocates size bytes from the slabs or the heap. The caller
+ * must hold the heap lock.
+ */
+static void *heap_malloc(size_t size)
+{
+    // small requests never touch the heap
+    if (size <= SLAB_MAX_SIZE)
+    {
+        return slab_alloc(size);
+    }
+
+    // Aligning size, every block needs room for the links of a free block
+    size = BLOCK_ALIGN(size);
+
+    // huge requests stay out of the heap
+    if (size >= mmap_threshold)
+    {
+        memory_block_t *block = map_block(size, ALIGNMENT);
+        return block ? get_payload(block) : NULL;
+    }
+
+    // a block of the same size freed lately is reused as is
+    if (size <= QUICK_MAX_SIZE)
+    {
+        memory_block_t *quick_block = quick_pop(size);
+        if (quick_block)
+        {
+            return get_payload(quick_block);
+        }
+    }
+
+    // find valid block
+    memory_block_t *free_block = find(size);
+
+    if (!free_block)
+    {
+        // extend heap when out of space
+        free_block = extend(size);
+        if (free_block == NULL)
+        {
+            return NULL;
+        }
+        add_free(free_block);
+    }
+
+    // take the space needed to allocate block
+    free_block = split(free_block, size);
+
+    // returns payload
+    return get_payload(free_block);
+}
+
+/*
+ * heap_free_block - gives a block that is not a slab slot back to its mapping
+ * or the heap. The caller must hold the heap lock and have checked the block
+ * with is_valid_payload, unless it trusts its own caller as ufree_sized does.
+ */
+static void heap_free_block(memory_block_t *free_block)
+{
+    if (is_mmapped(free_block))
+    {
+        unmap_block(free_block);
+        return;
+    }
+
+    // small blocks wait on a quick list until the lists grow too large
+    if (is_allocated(free_block) && get_size(free_block) <= QUICK_MAX_SIZE)
+    {
+        quick_push(free_block);
+        if (arena->quick_bytes > QUICK_MAX_BYTES)
+        {
+            consolidate();
+        }
+        return;
+    }
+
+    // only free if allocated already
+    if (is_allocated(free_block))
+    {
+        deallocate(free_block);
+
+        // merge with both neighbors if possible and add back to its bin
+        add_released(coalesce(free_block));
+    }
+}
+
+/*
+ * heap_free - gives an allocation back to its slab or the heap. Pointers
+ * umalloc did not hand out, or that were freed already, are ignored rather
+ * than corrupt the heap. The caller must hold the lock of the arena ptr
+ * belongs to.
+ */
+static void heap_free(void *ptr)
+{
+    uintptr_t entry = page_lookup(ptr);
+    if (!is_valid_payload(ptr, entry))
+    {
+        return;
+    }
+    if (page_kind(entry) == PAGE_SLAB)
+    {
+        slab_free(page_owner(entry), ptr);
+        return;
+    }
+    heap_free_block(get_block(ptr));
+}
+
+/*
+ * grow_block - tries to grow an allocated block to at least size bytes without
+ * moving it, by taking over the free block after it or extending the heap when
+ * the block ends the heap. Anything past room bytes is given back. Returns true
+ * on success.
+ */
+static bool grow_block(memory_block_t *block, size_t size, size_t room)
+{
+    memory_block_t *next_block = get_next_adjacent(block);
+
+    // a block at the top of the heap can grow into a new contiguous chunk
+    if (next_block == heap_top())
+    {
+        memory_block_t *extra_block = extend(size - get_size(block));
+        if (extra_block == NULL)
+        {
+            return false;
+        }
+        if (extra_block != next_block)
+        {
+            add_free(extra_block);
+            return false;
+        }
+    }
+    else if (is_allocated(next_block))
+    {
+        return false;
+    }
+    else
+    {
+        remove_free(next_block);
+    }
+
+    size_t total_size = get_size(block) + HEADER_SIZE + get_size(next_block);
+    if (total_size < size)
+    {
+        add_free(next_block);
+        return false;
+    }
+
+    bool prev_alloc = is_prev_allocated(block);
+    put_block(block, total_size, true);
+    set_prev_allocated(block, prev_alloc);
+    set_prev_allocated(get_next_adjacent(block), true);
+    trim_block(block, room);
+    return true;
+}
+
+/*
+ * heap_realloc - resizes a non-NULL allocation to a non-zero size. Heap blocks
+ * shrink and grow in place when they can, and are only moved when neither
+ * works. Blocks that grow keep up to half their size again as room, so a block
+ * growing in small steps is not moved every time.
+ */
+static void *heap_realloc(void *ptr, size_t size)
+{
+    size_t old_size;
+    size_t room = BLOCK_ALIGN(size + size / 2);
+    slab_t *slab = get_slab(ptr);
+    if (slab)
+    {
+        // a slot already has room for anything up to its size
+        old_size = slab->slot_size;
+        if (size <= old_size)
+        {
+            return ptr;
+        }
+    }
+    else if (is_mmapped(get_block(ptr)))
+    {
+        // a mapping can grow or shrink without copying, unless the block has
+        // become small enough for the heap
+        old_size = get_size(get_block(ptr));
+        if (size >= mmap_threshold)
+        {
+            memory_block_t *block = remap_block(get_block(ptr), size);
+            return block ? get_payload(block) : NULL;
+        }
+    }
+    else
+    {
+        memory_block_t *block = get_block(ptr);
+        size_t new_size = BLOCK_ALIGN(size);
+        old_size = get_size(block);
+
+        if (new_size <= old_size)
+        {
+            trim_block(block, room);
+            return ptr;
+        }
+        if (grow_block(block, new_size, room))
+        {
+            return ptr;
+        }
+    }
+
+    // neither worked, so the contents move to a new allocation, with room to
+    // spare if the heap can give it
+    void *new_ptr = heap_malloc(room);
+    if (new_ptr == NULL)
+    {
+        new_ptr = heap_malloc(size);
+    }
+    if (new_ptr == NULL)
+    {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    heap_free(ptr);
+    return new_ptr;
+}
+
+/*
+ * dirty_size - returns how many bytes at the start of the payload of a block
+ * made by extend may hold old data, given the epilogue the heap had before.
+ * csbrk hands out zeroed memory, so only a free block the new chunk was merged
+ * with and the links written while the block was free need clearing.
+ */
+static size_t dirty_size(memory_block_t *block, memory_block_t *old_epilogue)
+{
+    size_t dirty = sizeof(tree_node_t) - HEADER_SIZE;
+
+    // the new chunk starts after the old epilogue if it continues the heap
+    char *chunk = (char *)old_epilogue + HEADER_SIZE;
+    if (block <= old_epilogue && old_epilogue < get_next_adjacent(block) &&
+        (size_t)(chunk - (char *)get_payload(block)) > dirty)
+    {
+        dirty = chunk - (char *)get_payload(block);
+    }
+    return dirty;
+}
+
+/*
+ * heap_calloc - allocates total bytes set to zero. Memory that was just taken
+ * from csbrk is not cleared again.
+ */
+static void *heap_calloc(size_t total)
+{
+    if (total <= SLAB_MAX_SIZE)
+    {
+        void *slot = slab_alloc(total);
+        if (slot)
+        {
+            memset(slot, 0, total);
+        }
+        return slot;
+    }
+
+    // fresh mappings are always zero
+    size_t block_size = BLOCK_ALIGN(total);
+    if (block_size >= mmap_threshold)
+    {
+        memory_block_t *block = map_block(block_size, ALIGNMENT);
+        return block ? get_payload(block) : NULL;
+    }
+
+    size_t dirty = total;
+    memory_block_t *free_block = find(block_size);
+    if (!free_block)
+    {
+        memory_block_t *old_epilogue = heap_top();
+        free_block = extend(block_size);
+        if (free_block == NULL)
+        {
+            return NULL;
+        }
+        if (dirty_size(free_block, old_epilogue) < dirty)
+        {
+            dirty = dirty_size(free_block, old_epilogue);
+        }
+        add_free(free_block);
+    }
+    free_block = split(free_block, block_size);
+
+    // the footer of the free block may have ended up in the payload
+    void *payload = get_payload(free_block);
+    memset(payload, 0, dirty);
+    *((size_t *)((char *)payload + get_size(free_block)) - 1) = 0;
+    return payload;
+}
+
+/*
+ * heap_memalign - allocates size bytes at an address that is a multiple of
+ * alignment, which is a power of two larger than ALIGNMENT. The slack in front
+ * of the aligned block is given back as a free block rather than wasted.
+ */
+static void *heap_memalign(size_t alignment, size_t size)
+{
+    // slab slots are only aligned to ALIGNMENT, so the heap serves every size
+    size = BLOCK_ALIGN(size);
+    if (size >= mmap_threshold)
+    {
+        memory_block_t *block = map_block(size, alignment);
+        return block ? get_payload(block) : NULL;
+    }
+
+    // the slack is either nothing or a block of its own, so it can take up to
+    // alignment and a header, and a block that large must still have a size
+    // extend can grow the heap by
+    size_t search_size = BLOCK_ALIGN(size + alignment + HEADER_SIZE);
+    memory_block_t *free_block = find(search_size);
+    if (!free_block)
+    {
+        free_block = extend(search_size);
+        if (free_block == NULL)
+        {
+            return NULL;
+        }
+        add_free(free_block);
+    }
+
+    char *payload = get_payload(free_block);
+    size_t offset = (alignment - (size_t)payload % alignment) % alignment;
+    if (offset == 0)
+    {
+        return get_payload(split(free_block, size));
+    }
+    if (offset < HEADER_SIZE + ALIGNMENT)
+    {
+        offset += alignment;
+    }
+
+    remove_free(free_block);
+    size_t old_size = get_size(free_block);
+    bool prev_alloc = is_prev_allocated(free_block);
+
+    memory_block_t *aligned_block = get_block(payload + offset);
+    put_block(aligned_block, old_size - offset, true);
+    set_prev_allocated(get_next_adjacent(aligned_block), true);
+
+    // the slack in front becomes a free block, and the tail is trimmed off
+    put_block(free_block, offset - HEADER_SIZE, false);
+    set_prev_allocated(free_block, prev_alloc);
+    add_free(coalesce(free_block));
+    trim_block(aligned_block, size);
+
+    return get_payload(aligned_block);
+}
+
+/*
+ * carve - allocates up to count blocks of size bytes back to back from the
+ * start of a free block, storing their payloads in out, and bins what is left.
+ * Returns how many blocks the free block held.
+ */
+static size_t carve(memory_block_t *free_block, size_t size, size_t count, void **out)
+{
+    size_t stride = size + HEADER_SIZE;
+    size_t old_size = get_size(free_block);
+    if (count > (old_size + HEADER_SIZE) / stride)
+    {
+        count = (old_size + HEADER_SIZE) / stride;
+    }
+
+    remove_free(free_block);
+    bool first_prev_alloc = is_prev_allocated(free_block);
+    char *cur = (char *)free_block;
+    for (size_t i = 0; i < count; i++)
+    {
+        put_block((memory_block_t *)cur, size, true);
+        set_prev_allocated((memory_block_t *)cur, i > 0 || first_prev_alloc);
+        out[i] = get_payload((memory_block_t *)cur);
+        cur += stride;
+    }
+
+    // like split, a leftover too small to use goes to the last block, and the
+    // block after a free leftover already knows its neighbor is free
+    size_t left = old_size + HEADER_SIZE - count * stride;
+    if (left > HEADER_SIZE + ALIGNMENT)
+    {
+        memory_block_t *leftover = (memory_block_t *)cur;
+        put_block(leftover, left - HEADER_SIZE, false);
+        set_prev_allocated(leftover, true);
+        add_free(leftover);
+    }
+    else
+    {
+        memory_block_t *last = get_block(out[count - 1]);
+        put_block(last, size + left, true);
+        set_prev_allocated(last, count > 1 || first_prev_alloc);
+        set_prev_allocated(get_next_adjacent(last), true);
+    }
+    return count;
+}
+
+/*
+ * heap_malloc_batch - allocates n blocks of size bytes each into out. Heap
+ * blocks are carved side by side out of as few free blocks as possible, each
+ * found with a single search. Returns how many blocks were allocated, which
+ * is only less than n if memory ran out. The caller must hold the heap lock.
+ */
+static size_t heap_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t count = 0;
+
+    // slab slots are found without a search already, and huge blocks each get
+    // a mapping of their own; both are decided on the size asked for, as in
+    // heap_malloc
+    if (size <= SLAB_MAX_SIZE || BLOCK_ALIGN(size) >= mmap_threshold)
+    {
+        for (; count < n; count++)
+        {
+            out[count] = heap_malloc(size);
+            if (out[count] == NULL)
+            {
+                break;
+            }
+        }
+        return count;
+    }
+
+    // a run of blocks never needs more than one chunk from csbrk
+    size = BLOCK_ALIGN(size);
+    size_t stride = size + HEADER_SIZE;
+    size_t max_run = (MMAP_THRESHOLD_MAX + HEADER_SIZE) / stride;
+    while (count < n)
+    {
+        size_t run = (n - count < max_run) ? n - count : max_run;
+        size_t run_size = run * stride - HEADER_SIZE;
+
+        // a block that holds the whole run is best, otherwise any block that
+        // holds one of them is cut up before the heap grows
+        memory_block_t *free_block = find(run_size);
+        if (!free_block)
+        {
+            free_block = find(size);
+        }
+        if (!free_block)
+        {
+            free_block = extend(run_size);
+            if (free_block == NULL)
+            {
+                break;
+            }
+            add_free(free_block);
+        }
+        count += carve(free_block, size, run, out + count);
+    }
+    return count;
+}
+
+/*
+ * compare_address - orders pointers by address, for qsort.
+ */
+static int compare_address(const void *a, const void *b)
+{
+    char *ptr_a = *(char *const *)a;
+    char *ptr_b = *(char *const *)b;
+    return (ptr_a > ptr_b) - (ptr_a < ptr_b);
+}
+
+/*
+ * heap_free_batch - frees the n allocations in ptrs, sorting ptrs by address
+ * first. Heap blocks that lie side by side are freed as a single block, which
+ * is coalesced and binned once. The caller must hold the heap lock.
+ */
+static void heap_free_batch(void **ptrs, size_t n)
+{
+    qsort(ptrs, n, sizeof(void *), compare_address);
+
+    size_t i = 0;
+    while (i < n)
+    {
+        void *ptr = ptrs[i++];
+        uintptr_t entry = ptr ? page_lookup(ptr) : 0;
+        if (ptr == NULL || !is_valid_payload(ptr, entry))
+        {
+            continue;
+        }
+        if (page_kind(entry) == PAGE_SLAB)
+        {
+            slab_free(page_owner(entry), ptr);
+            continue;
+        }
+        memory_block_t *first = get_block(ptr);
+        if (is_mmapped(first))
+        {
+            heap_free_block(first);
+            continue;
+        }
+
+        // blocks after the first that were also freed join it
+        memory_block_t *end = get_next_adjacent(first);
+        while (i < n && ptrs[i] == get_payload(end) && is_allocated(end) && get_size(end) != 0 && !is_quick(end))
+        {
+            end = get_next_adjacent(end);
+            i++;
+        }
+
+        bool prev_alloc = is_prev_allocated(first);
+        put_block(first, (char *)end - (char *)get_payload(first), false);
+        set_prev_allocated(first, prev_alloc);
+        add_released(coalesce(first));
+    }
+}
+
+#ifdef UMALLOC_THREADS
+/*
+ * get_arena - returns the arena an allocation belongs to, given the page map
+ * entry of its page.
+ */
+static arena_t *get_arena(void *ptr, uintptr_t entry)
+{
+    if (page_kind(entry) == PAGE_SLAB)
+    {
+        return ((slab_t *)page_owner(entry))->arena;
+    }
+    return (arena_t *)get_block(ptr)->next;
+}
+
+/*
+ * payload_size - returns how many bytes an allocation can hold, given the page
+ * map entry of its page. Other threads may set the previous allocated bit of
+ * a block meanwhile, but never its size.
+ */
+static size_t payload_size(void *ptr, uintptr_t entry)
+{
+    if (page_kind(entry) == PAGE_SLAB)
+    {
+        return ((slab_t *)page_owner(entry))->slot_size;
+    }
+    return get_size(get_block(ptr));
+}
+
+/*
+ * remote_free - hands an allocation back to the arena it belongs to from a
+ * thread of another arena. Any number of threads can push at once without a
+ * lock, and since the arena only ever takes the whole stack there is no ABA.
+ * The allocation gets its free mark, so freeing it again before the arena
+ * took the stack goes to owner_free instead of pushing it twice.
+ */
+static void remote_free(arena_t *owner, void *ptr)
+{
+    *free_mark(ptr) = (uintptr_t)ptr ^ FREE_MAGIC;
+    void *head = atomic_load_explicit(&owner->remote_frees, memory_order_relaxed);
+    do
+    {
+        *(void **)ptr = head;
+    } while (!atomic_compare_exchange_weak_explicit(&owner->remote_frees, &head, ptr,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+/*
+ * drain_remote_frees - frees everything other threads handed back to the
+ * calling thread's arena. The caller must hold the arena's lock.
+ */
+static void drain_remote_frees()
+{
+    if (atomic_load_explicit(&arena->remote_frees, memory_order_relaxed) == NULL)
+    {
+        return;
+    }
+
+    void *ptr = atomic_exchange_explicit(&arena->remote_frees, NULL, memory_order_acquire);
+    while (ptr)
+    {
+        void *next = *(void **)ptr;
+        *free_mark(ptr) = 0;
+        heap_free(ptr);
+        ptr = next;
+    }
+}
+
+/*
+ * owner_free - frees ptr under the lock of the arena it belongs to from a
+ * thread of another arena. Allocations that carry the free mark come here
+ * instead of remote_free, which would overwrite the link they may have on a
+ * quick list or the remote_frees stack; with the stack taken back first,
+ * heap_free can tell whether they were freed already. The caller must not
+ * hold any arena's lock.
+ */
+static void owner_free(arena_t *owner, void *ptr)
+{
+    arena_t *self = arena;
+    arena = owner;
+    pthread_mutex_lock(&owner->lock);
+    drain_remote_frees();
+    heap_free(ptr);
+    pthread_mutex_unlock(&owner->lock);
+    arena = self;
+}
+#endif
+
+/*
+ * heap_lock - locks the calling thread's arena, if the allocator is built for
+ * threads. Threads are bound to an arena the first time they need one, and
+ * the arena frees what other threads handed back to it since it was last
+ * locked.
+ */
+static void heap_lock()
+{
+#ifdef UMALLOC_THREADS
+    if (arena == NULL)
+    {
+        arena = &arenas[atomic_fetch_add(&next_arena, 1) % NUM_ARENAS];
+    }
+    pthread_mutex_lock(&arena->lock);
+    drain_remote_frees();
+#endif
+}
+
+/*
+ * heap_unlock - unlocks the arena locked by heap_lock.
+ */
+static void heap_unlock()
+{
+#ifdef UMALLOC_THREADS
+    pthread_mutex_unlock(&arena->lock);
+#endif
+}
+
+#ifdef UMALLOC_THREADS
+/*
+ * tcache_flush - gives up to count blocks of a cache bin back to the arenas
+ * they belong to. The caller must hold the lock of its own arena.
+ */
+static void tcache_flush(tcache_bin_t *bin, size_t count)
+{
+    while (bin->head && count > 0)
+    {
+        void *ptr = bin->head;
+        bin->head = *(void **)ptr;
+        *free_mark(ptr) = 0;
+        bin->count--;
+        count--;
+
+        arena_t *owner = get_arena(ptr, page_lookup(ptr));
+        if (owner == arena)
+        {
+            heap_free(ptr);
+        }
+        else
+        {
+            remote_free(owner, ptr);
+        }
+    }
+}
+
+/*
+ * tcache_destroy - empties the cache of a thread that is exiting.
+ */
+static void tcache_destroy(void *cache)
+{
+    tcache_bin_t *bins = cache;
+    heap_lock();
+    for (int tcache_class = 0; tcache_class < TCACHE_CLASSES; tcache_class++)
+    {
+        tcache_flush(&bins[tcache_class], bins[tcache_class].count);
+    }
+    heap_unlock();
+}
+
+/*
+ * tcache_make_key - creates the key whose destructor empties thread caches.
+ */
+static void tcache_make_key()
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * tcache_register - makes sure the calling thread's cache is emptied when the
+ * thread exits.
+ */
+static void tcache_register()
+{
+    pthread_once(&tcache_key_once, tcache_make_key);
+    pthread_setspecific(tcache_key, tcache);
+    tcache_registered = true;
+}
+
+/*
+ * tcache_alloc - hands out a block of at least size bytes from the calling
+ * thread's cache, refilling the size class from the heap when it is empty.
+ */
+static void *tcache_alloc(size_t size)
+{
+    int tcache_class = (size < ALIGNMENT) ? 0 : ALIGN(size) / ALIGNMENT - 1;
+    tcache_bin_t *bin = &tcache[tcache_class];
+
+    if (bin->head == NULL)
+    {
+        if (!tcache_registered)
+        {
+            tcache_register();
+        }
+
+        // one trip to the heap fills the bin halfway
+        heap_lock();
+        for (int i = 0; i < TCACHE_BATCH; i++)
+        {
+            void *ptr = heap_malloc((tcache_class + 1) * ALIGNMENT);
+            if (ptr == NULL)
+            {
+                break;
+            }
+            *(void **)ptr = bin->head;
+            bin->head = ptr;
+            bin->count++;
+        }
+        heap_unlock();
+
+        if (bin->head == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    void *ptr = bin->head;
+    bin->head = *(void **)ptr;
+    *free_mark(ptr) = 0;
+    bin->count--;
+    return ptr;
+}
+
+/*
+ * is_cached - returns true if ptr is in the given bin of the calling thread's
+ * cache. Like is_quick, it only looks through the bin if the second word of
+ * ptr holds the mark tcache_free leaves there.
+ */
+static bool is_cached(tcache_bin_t *bin, void *ptr)
+{
+    if (*free_mark(ptr) != ((uintptr_t)bin ^ FREE_MAGIC))
+    {
+        return false;
+    }
+    void *cur = bin->head;
+    while (cur && cur != ptr)
+    {
+        cur = *(void **)cur;
+    }
+    return cur == ptr;
+}
+
+/*
+ * tcache_free - puts an allocation that can hold size bytes in the calling
+ * thread's cache, flushing half of its bin to the heap when the bin is full.
+ * Returns false if the allocation is too large to be cached.
+ */
+static bool tcache_free(void *ptr, size_t size)
+{
+    // blocks from the heap may be larger than requested, so they are cached by
+    // the size they really have
+    if (size > TCACHE_MAX_SIZE)
+    {
+        return false;
+    }
+
+    tcache_bin_t *bin = &tcache[size / ALIGNMENT - 1];
+    if (!tcache_registered)
+    {
+        tcache_register();
+    }
+
+    // an allocation that is cached already was freed twice
+    if (is_cached(bin, ptr))
+    {
+        return true;
+    }
+    *(void **)ptr = bin->head;
+    *free_mark(ptr) = (uintptr_t)bin ^ FREE_MAGIC;
+    bin->head = ptr;
+    bin->count++;
+
+    if (bin->count >= TCACHE_COUNT)
+    {
+        heap_lock();
+        tcache_flush(bin, TCACHE_BATCH);
+        heap_unlock();
+    }
+    return true;
+}
+#endif
+
+/*
+ * umalloc -  allocates size bytes and returns a pointer to the allocated memory.
+ */
+void *umalloc(size_t size)
+{
+#ifdef UMALLOC_THREADS
+    if (size <= TCACHE_MAX_SIZE)
+    {
+        return tcache_alloc(size);
+    }
+#endif
+
+    heap_lock();
+    void *ptr = heap_malloc(size);
+    heap_unlock();
+    return ptr;
+}
+
+/*
+ * ufree -  frees the memory space pointed to by ptr, which must have been called
+ * by a previous call to malloc.
+ */
+void ufree(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+#ifdef UMALLOC_THREADS
+    // pointers umalloc did not hand out are ignored before anything is written
+    // to them, while the full check waits for the lock of their arena
+    uintptr_t entry = page_lookup(ptr);
+    if (!looks_allocated(ptr, entry))
+    {
+        return;
+    }
+    bool marked = has_free_mark(ptr);
+    if (!marked && tcache_free(ptr, payload_size(ptr, entry)))
+    {
+        return;
+    }
+
+    if (page_kind(entry) == PAGE_MAPPED)
+    {
+        unmap_block(get_block(ptr));
+        return;
+    }
+
+    arena_t *owner = get_arena(ptr, entry);
+    if (owner != arena)
+    {
+        if (marked)
         {
-            // add in front of head when earlier address and check to coalesce with old head
-            free_block->next = free_head;
-            free_head = free_block;
-            coalesce(free_block);
+            owner_free(owner, ptr);
         }
         else
         {
-            // adding the block back into the middle of the list or end & coalesce adjacent blocks
-            memory_block_t *block_position = free_head;
-            while (get_next(block_position) && get_next(block_position) < free_block)
+            remote_free(owner, ptr);
+        }
+        return;
+    }
+#endif
+
+    heap_lock();
+    heap_free(ptr);
+    heap_unlock();
+}
+
+/*
+ * ufree_sized - frees ptr like ufree, given the size it was last allocated or
+ * reallocated with, which spares most of the lookup ufree makes to find out
+ * what ptr is. Unlike ufree, nothing checks that ptr is an allocation umalloc
+ * handed out and has not been freed since; the caller has to be sure of it.
+ */
+void ufree_sized(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+#ifdef UMALLOC_THREADS
+    // an allocation holds at least ALIGN(size) bytes, so it can be cached by
+    // that size without looking up the size it really has
+    if (size <= TCACHE_MAX_SIZE && tcache_free(ptr, (size < ALIGNMENT) ? ALIGNMENT : ALIGN(size)))
+    {
+        return;
+    }
+#endif
+
+    // a small size may still belong to an aligned or shrunk heap block, so
+    // the page map entry tells a slab slot apart, and the slot then goes
+    // straight to its slab without the checks ufree makes first
+    if (size <= SLAB_MAX_SIZE)
+    {
+        uintptr_t entry = page_lookup(ptr);
+        if (page_kind(entry) == PAGE_SLAB)
+        {
+            slab_t *slab = page_owner(entry);
+#ifdef UMALLOC_THREADS
+            if (slab->arena != arena)
+            {
+                remote_free(slab->arena, ptr);
+                return;
+            }
+#endif
+            heap_lock();
+            slab_free(slab, ptr);
+            heap_unlock();
+            return;
+        }
+    }
+
+    // the header of a heap block is still read: the block may hold more than
+    // size bytes, and coalescing needs its real size and flags either way
+    memory_block_t *block = get_block(ptr);
+#ifdef UMALLOC_THREADS
+    if (is_mmapped(block))
+    {
+        unmap_block(block);
+        return;
+    }
+
+    arena_t *owner = (arena_t *)block->next;
+    if (owner != arena)
+    {
+        remote_free(owner, ptr);
+        return;
+    }
+#endif
+
+    heap_lock();
+    heap_free_block(block);
+    heap_unlock();
+}
+
+/*
+ * umalloc_batch - allocates n blocks of size bytes each, storing them in out.
+ * Returns how many were allocated, which is less than n only if memory ran
+ * out; those that were allocated must still be freed.
+ */
+size_t umalloc_batch(size_t size, size_t n, void **out)
+{
+#ifdef UMALLOC_THREADS
+    // the thread cache hands out small blocks faster than any batch
+    if (size <= TCACHE_MAX_SIZE)
+    {
+        size_t count = 0;
+        while (count < n && (out[count] = tcache_alloc(size)) != NULL)
+        {
+            count++;
+        }
+        return count;
+    }
+#endif
+
+    heap_lock();
+    size_t count = heap_malloc_batch(size, n, out);
+    heap_unlock();
+    return count;
+}
+
+/*
+ * ufree_batch - frees the n allocations in ptrs, any of which may be NULL, at
+ * once. ptrs is left in an unspecified order.
+ */
+void ufree_batch(void **ptrs, size_t n)
+{
+#ifdef UMALLOC_THREADS
+    // only the arena's own blocks are freed in a batch, the rest go to the
+    // thread cache, their mappings and their arenas one by one
+    size_t own = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        void *ptr = ptrs[i];
+        if (ptr == NULL)
+        {
+            continue;
+        }
+        uintptr_t entry = page_lookup(ptr);
+        if (!looks_allocated(ptr, entry))
+        {
+            continue;
+        }
+        bool marked = has_free_mark(ptr);
+        if (!marked && tcache_free(ptr, payload_size(ptr, entry)))
+        {
+            continue;
+        }
+        if (page_kind(entry) == PAGE_MAPPED)
+        {
+            unmap_block(get_block(ptr));
+            continue;
+        }
+        arena_t *owner = get_arena(ptr, entry);
+        if (owner != arena)
+        {
+            if (marked)
+            {
+                owner_free(owner, ptr);
+            }
+            else
+            {
+                remote_free(owner, ptr);
+            }
+            continue;
+        }
+        ptrs[own++] = ptr;
+    }
+    n = own;
+#endif
+
+    heap_lock();
+    heap_free_batch(ptrs, n);
+    heap_unlock();
+}
+
+/*
+ * urealloc - changes the size of the allocation at ptr to size bytes, keeping
+ * its contents, and returns where it now is.
+ */
+void *urealloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return umalloc(size);
+    }
+    if (size == 0)
+    {
+        ufree(ptr);
+        return NULL;
+    }
+
+#ifdef UMALLOC_THREADS
+    // only the arena a block belongs to may resize it, anyone else moves it
+    uintptr_t entry = page_lookup(ptr);
+    if (page_kind(entry) != PAGE_MAPPED && get_arena(ptr, entry) != arena)
+    {
+        size_t old_size = payload_size(ptr, entry);
+        void *new_ptr = umalloc(size);
+        if (new_ptr)
+        {
+            memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+            ufree(ptr);
+        }
+        return new_ptr;
+    }
+#endif
+
+    heap_lock();
+    ptr = heap_realloc(ptr, size);
+    heap_unlock();
+    return ptr;
+}
+
+/*
+ * ucalloc - allocates an array of nmemb elements of size bytes each, with every
+ * byte set to zero.
+ */
+void *ucalloc(size_t nmemb, size_t size)
+{
+    if (size != 0 && nmemb > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+
+    heap_lock();
+    void *ptr = heap_calloc(nmemb * size);
+    heap_unlock();
+    return ptr;
+}
+
+/*
+ * umemalign - allocates size bytes at an address that is a multiple of
+ * alignment, which must be a power of two.
+ */
+void *umemalign(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT)
+    {
+        return umalloc(size);
+    }
+
+    heap_lock();
+    void *ptr = heap_memalign(alignment, size);
+    heap_unlock();
+    return ptr;
+}
+
+/*
+ * uposix_memalign - like umemalign, but stores the allocation in memptr and
+ * returns an error number, which is EINVAL if alignment is not a power of two
+ * multiple of the size of a pointer.
+ */
+int uposix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+    {
+        return EINVAL;
+    }
+
+    void *ptr = umemalign(alignment, size);
+    if (ptr == NULL)
+    {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+/*
+ * umalloc_set_mmap_threshold - gives requests of at least threshold bytes a
+ * mapping of their own from now on, and stops the threshold from adapting.
+ * Thresholds past what the heap can serve become MMAP_THRESHOLD_MAX.
+ */
+void umalloc_set_mmap_threshold(size_t threshold)
+{
+    mmap_threshold = (threshold < MMAP_THRESHOLD_MAX) ? threshold : MMAP_THRESHOLD_MAX;
+    mmap_threshold_fixed = true;
+}
+
+/*
+ * release_slabs - unmaps the empty slabs of the calling thread's arena,
+ * returning true if there were any.
+ */
+static bool release_slabs()
+{
+    bool released = arena->slab_empty != NULL;
+    while (arena->slab_empty)
+    {
+        slab_t *slab = arena->slab_empty;
+        arena->slab_empty = slab->next;
+        page_map_set(slab, (char *)slab + PAGESIZE, NULL, PAGE_NONE);
+        munmap(slab, PAGESIZE);
+        mmap_bytes -= PAGESIZE;
+    }
+
+#ifdef UMALLOC_CHECK
+    // the change log may still name the slabs
+    if (released)
+    {
+        arena->dirty_slab_count = DIRTY_LOG_SIZE + 1;
+    }
+#endif
+    return released;
+}
+
+/*
+ * utrim - gives the memory of the calling thread's arena that is not in use
+ * back to the OS right away: the top of the heap down to pad bytes, the empty
+ * slabs, and the whole pages inside every free block. Returns 1 if anything
+ * was released.
+ */
+int utrim(size_t pad)
+{
+    heap_lock();
+    consolidate();
+    bool released = trim_top(pad);
+    released |= release_slabs();
+    for (int bin = 0; bin < NUM_BINS; bin++)
+    {
+        for (memory_block_t *block = arena->free_bins[bin]; block; block = block->next)
+        {
+            released |= release_pages(block);
+        }
+    }
+    released |= release_tree(arena->tree_root);
+    heap_unlock();
+    return released;
+}
+
+/*
+ * resident_pages - counts the pages the page map names below a node at the
+ * given level that are in memory, first_page being the page number of its
+ * first entry. Pages released with madvise are not, until they are touched.
+ */
+static size_t resident_pages(THREAD_SHARED uintptr_t *node, int level, size_t first_page)
+{
+    size_t resident = 0;
+    for (size_t i = 0; i < PAGE_MAP_SIZE; i++)
+    {
+        if (node[i] == 0)
+        {
+            continue;
+        }
+        size_t page = first_page | (i << (level * PAGE_MAP_BITS));
+        if (level > 0)
+        {
+            resident += resident_pages((THREAD_SHARED uintptr_t *)node[i], level - 1, page);
+            continue;
+        }
+
+        // mincore takes the whole run of owned pages in the leaf at once
+        size_t run = 1;
+        while (i + run < PAGE_MAP_SIZE && node[i + run])
+        {
+            run++;
+        }
+        unsigned char in_core[PAGE_MAP_SIZE];
+        if (mincore((void *)(page << PAGE_SHIFT), run << PAGE_SHIFT, in_core) == 0)
+        {
+            for (size_t j = 0; j < run; j++)
+            {
+                resident += in_core[j] & 1;
+            }
+        }
+        i += run - 1;
+    }
+    return resident;
+}
+
+/*
+ * tree_stats - adds the blocks of the size tree at node to the free block
+ * counts of stats.
+ */
+static void tree_stats(tree_node_t *node, umalloc_stats_t *stats)
+{
+    if (node == NULL)
+    {
+        return;
+    }
+    tree_stats(node->left, stats);
+    for (memory_block_t *block = &node->block; block; block = block->next)
+    {
+        stats->free_blocks++;
+        stats->free_bytes += get_size(block);
+    }
+    if (get_size(&node->block) > stats->largest_free)
+    {
+        stats->largest_free = get_size(&node->block);
+    }
+    tree_stats(node->right, stats);
+}
+
+/*
+ * umalloc_stats - fills in stats for every arena together. The counters are
+ * only kept by a build with UMALLOC_STATS; the free blocks and headers are
+ * counted by walking the heap, which takes each arena's lock in turn.
+ */
+void umalloc_stats(umalloc_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+#ifdef UMALLOC_STATS
+    stats->counted = true;
+#endif
+
+    for (int i = 0; i < NUM_ARENAS; i++)
+    {
+        arena_t *walk = &arenas[i];
+#ifdef UMALLOC_THREADS
+        pthread_mutex_lock(&walk->lock);
+#endif
+#ifdef UMALLOC_STATS
+        umalloc_stats_t *counters = &arena_stats[i];
+        stats->find_calls += counters->find_calls;
+        stats->split_calls += counters->split_calls;
+        stats->coalesce_calls += counters->coalesce_calls;
+        stats->extend_calls += counters->extend_calls;
+        stats->splits += counters->splits;
+        stats->merges += counters->merges;
+        for (int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+        {
+            stats->search_lengths[bucket] += counters->search_lengths[bucket];
+        }
+#endif
+
+        for (int bin = 0; bin < NUM_BINS; bin++)
+        {
+            for (memory_block_t *block = walk->free_bins[bin]; block; block = block->next)
+            {
+                stats->free_blocks++;
+                stats->free_bytes += get_size(block);
+                if (get_size(block) > stats->largest_free)
+                {
+                    stats->largest_free = get_size(block);
+                }
+            }
+        }
+        tree_stats(walk->tree_root, stats);
+
+        // every block has a header, the prologue and epilogue included
+        for (region_t *region = walk->regions; region; region = region->next)
+        {
+            stats->header_bytes += sizeof(region_t) + HEADER_SIZE;
+            memory_block_t *block = (memory_block_t *)(region + 1);
+            while (block != region->epilogue)
             {
-                block_position = get_next(block_position);
+                block = get_next_adjacent(block);
+                stats->header_bytes += HEADER_SIZE;
             }
-            free_block->next = block_position->next;
-            block_position->next = free_block;
-            coalesce(free_block);
-            coalesce(block_position);
         }
+#ifdef UMALLOC_THREADS
+        pthread_mutex_unlock(&walk->lock);
+#endif
     }
+    stats->resident_bytes = resident_pages(page_map, PAGE_MAP_LEVELS - 1, 0) << PAGE_SHIFT;
 }
@@ -1,39 +1,401 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#ifdef UMALLOC_THREADS
+#include <pthread.h>
+#endif
 
 #define ALIGNMENT 16 /* The alignment of all payloads returned by umalloc */
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
+/*
+ * Free blocks are kept in segregated size-class bins. Bins 0-15 hold exactly
+ * one payload size each (16, 32, ... 256 bytes), the remaining bins each cover
+ * a power of two range, and the last bin holds everything larger.
+ * Free blocks of at least TREE_THRESHOLD bytes skip the bins and are indexed
+ * by size in a balanced tree instead, which gives a best fit for them.
+ */
+#define NUM_BINS 32
+#define EXACT_BINS 16
+#define EXACT_BIN_LIMIT (EXACT_BINS * ALIGNMENT)
+
+/*
+ * Each arena marks its non-empty bins in a bitmap of BIN_WORDS words, and
+ * marks the words with a bin set in a summary word above it. The first
+ * non-empty bin past any other is then found with a count-trailing-zeros on
+ * each level, however many empty bins lie in between.
+ */
+#define BIN_WORDS ((NUM_BINS + 63) / 64)
+
+#ifndef TREE_THRESHOLD
+#define TREE_THRESHOLD 512
+#endif
+
+/*
+ * PLACEMENT picks, at build time, which of the free blocks of a bin that fit
+ * a request find() takes: first fit takes the first one, next fit the first
+ * one after where the last search of the bin left off, best fit the smallest,
+ * and good fit the smallest of the first GOOD_FIT_CANDIDATES. The size tree
+ * gives the best fit of the large blocks under every policy.
+ */
+#define PLACEMENT_FIRST_FIT 0
+#define PLACEMENT_NEXT_FIT 1
+#define PLACEMENT_BEST_FIT 2
+#define PLACEMENT_GOOD_FIT 3
+
+#ifndef PLACEMENT
+#define PLACEMENT PLACEMENT_FIRST_FIT
+#endif
+
+/*
+ * Heap blocks of up to QUICK_MAX_SIZE bytes that are freed go on a LIFO quick
+ * list for their size first, still marked allocated, so freeing them skips
+ * coalescing and allocating the same size again skips the search and split.
+ * The quick lists are consolidated into the bins once they hold more than
+ * QUICK_MAX_BYTES, and whenever find() comes up empty. The second word of a
+ * payload that waits on a quick list, or on the remote_frees of its arena,
+ * holds its address XOR FREE_MAGIC, which tells it apart from an allocation
+ * that is really in use when it is freed again.
+ */
+#define QUICK_LISTS 32
+#define FREE_MAGIC ((uintptr_t)0x5155494b4c495354)
+#define QUICK_MAX_SIZE (QUICK_LISTS * ALIGNMENT - HEADER_SIZE)
+#ifndef QUICK_MAX_BYTES
+#define QUICK_MAX_BYTES (64 * 1024)
+#endif
+
+#ifndef GOOD_FIT_CANDIDATES
+#define GOOD_FIT_CANDIDATES 4
+#endif
+
 /*
  * memory_block_t - Represents a block of memory managed by the heap. The 
  * struct can be left as is, or modified for your design.
  * In the current design bit0 is the allocated bit
- * bits 1-3 are unused.
- * and the remaining 60 bit represent the size.
+ * bit1 is set when the block physically before this one is allocated
+ * bit2 is set when the block has an anonymous mapping of its own
+ * and the remaining 61 bit represent the size, a multiple of 8.
+ * Free blocks also keep a copy of their size in the last word of the payload
+ * (the footer), so the block after them can find where they start.
+ * Only block_metadata makes up the header, next and prev live in the first
+ * words of the payload and are only valid while the block is free. Built with
+ * UMALLOC_THREADS, next stays in the header, where allocated blocks keep
+ * their arena.
  */
 typedef struct memory_block_struct {
     size_t block_metadata; // This field stores the block size in bits [63:4], and allocation status in bit 0
     struct memory_block_struct *next;
+    struct memory_block_struct *prev;
 } memory_block_t;
 
+#ifdef UMALLOC_THREADS
+#define HEADER_SIZE offsetof(memory_block_t, prev) /* bytes in front of every payload */
+#else
+#define HEADER_SIZE offsetof(memory_block_t, next)
+#endif
+
+/*
+ * The header and payload of a heap block together always take a multiple of
+ * ALIGNMENT, which keeps every payload aligned, and a payload is never too
+ * small to hold the links and footer of a free block. BLOCK_ALIGN gives the
+ * payload size a request of size bytes gets.
+ */
+#define MIN_BLOCK_SIZE (sizeof(memory_block_t) - HEADER_SIZE + sizeof(size_t))
+#define BLOCK_ALIGN(size) ((size) < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : ALIGN((size) + HEADER_SIZE) - HEADER_SIZE)
+
+/*
+ * tree_node_t - A free block in the size tree (an AVL tree). The block's next
+ * and prev link the other free blocks of the same size, which hang off the
+ * node without being part of the tree; only the node itself has no prev.
+ */
+typedef struct tree_node_struct {
+    memory_block_t block;
+    struct tree_node_struct *left;
+    struct tree_node_struct *right;
+    size_t height;
+} tree_node_t;
+
+/*
+ * Requests of up to SLAB_MAX_SIZE bytes are served from slabs instead: pages
+ * mapped on their own that start with a slab_t and are carved into equal-size
+ * slots with no header at all. ufree finds the slab_t of a slot through the
+ * page map. Each slab marks the slots it handed out in a bitmap with a bit
+ * per ALIGNMENT bytes of its page, so a slot that is freed twice is caught.
+ */
+#define PAGE_SHIFT 12 /* pages are 1 << PAGE_SHIFT bytes, PAGESIZE in csbrk.h */
+#define SLAB_MAX_SIZE 128
+#define SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_HEADER_SIZE ALIGN(sizeof(slab_t))
+#define SLAB_MAP_WORDS ((1 << PAGE_SHIFT) / ALIGNMENT / 64)
+
+typedef struct slab_struct {
+    struct slab_struct *next;      // links the slabs of a class with free slots
+    struct slab_struct *prev;
+    void *free_slots;              // freed slots, linked through their first word
+    char *unused;                  // the first slot that was never handed out
+    size_t slot_size;
+    size_t used;                   // the number of slots handed out
+    struct arena_struct *arena;    // the arena the slab belongs to
+    uint64_t in_use[SLAB_MAP_WORDS]; // a set bit at the start of each slot handed out
+} slab_t;
+
+/*
+ * The heap is made of regions, runs of memory from csbrk that other users of
+ * the break may leave gaps between. Each region starts with its region_t and
+ * an allocated prologue of size zero, and ends with an allocated epilogue of
+ * size zero, so walking or coalescing blocks never leaves it. The
+ * region_t of each arena are linked newest first; only the newest can grow,
+ * and a chunk that continues it is merged into it rather than made a region.
+ */
+typedef struct region_struct {
+    struct region_struct *next;    // the region made before this one
+    memory_block_t *epilogue;      // the zero-size block that ends the region
+    struct region_struct *below;   // a region of any arena that ends on this one's first page
+    struct arena_struct *arena;    // the arena the region belongs to
+} region_t;
+
+/*
+ * The page map records what owns each page the allocator got from csbrk or
+ * mmap: the region_t of a heap region, the slab_t of a slab, or the header of
+ * a block with a mapping of its own. It is a radix tree with PAGE_MAP_BITS
+ * bits of the page number per level, so finding the owner of any address
+ * takes PAGE_MAP_LEVELS loads. The low bits of an entry give its kind. A page
+ * where one region ends and another begins maps to the later region, whose
+ * below leads to the earlier one.
+ *
+ * Three levels of 12 bits over 12-bit pages cover 48-bit addresses, which is
+ * all x86-64 and AArch64 hand out with 4-level page tables, and all Linux
+ * hands out under 5-level tables unless mmap is given a higher hint. Memory
+ * above that is never mapped: page_slot refuses it, so csbrk and mmap results
+ * there fail like a failed mmap and lookups treat the address as foreign.
+ */
+#define PAGE_MAP_BITS 12
+#define PAGE_MAP_LEVELS 3
+#define PAGE_MAP_SIZE (1 << PAGE_MAP_BITS)
+#define PAGE_KIND_MASK 0x3
+
+typedef enum {
+    PAGE_NONE,                     // the allocator does not own the page
+    PAGE_HEAP,                     // the page holds blocks of a heap region
+    PAGE_SLAB,                     // the page is a slab
+    PAGE_MAPPED,                   // the page belongs to a block with its own mapping
+} page_kind_t;
+
+#define REGION_OVERHEAD (3 * HEADER_SIZE + sizeof(region_t)) /* bytes of a region outside its first block */
+
+/*
+ * The heap grows by at least GROW_MIN bytes at a time. While it stays
+ * contiguous, each growth doubles the next one up to GROW_MAX, and a growth
+ * also covers GROW_AHEAD misses of the average size of the last GROW_HISTORY
+ * or so, so a heap that keeps growing makes fewer csbrk calls. A chunk that
+ * starts a new region drops back to GROW_MIN, since the tail of a region that
+ * other users of the break cut off is wasted. GROW_MAX may not be more than
+ * the 64 KB csbrk hands out at once.
+ */
+#ifndef GROW_MIN
+#define GROW_MIN PAGESIZE
+#endif
+#ifndef GROW_MAX
+#define GROW_MAX (16 * PAGESIZE)
+#endif
+#ifndef GROW_AHEAD
+#define GROW_AHEAD 2
+#endif
+#ifndef GROW_HISTORY
+#define GROW_HISTORY 4
+#endif
+
+/*
+ * Requests of at least the mmap threshold get an anonymous mapping of their
+ * own instead of a heap block, which ufree unmaps right away. The threshold
+ * starts at MMAP_THRESHOLD and adapts unless it was set explicitly: freeing a
+ * mapped block larger than it raises it to that size, so buffers that are
+ * allocated and freed over and over end up in the heap. It never goes past
+ * MMAP_THRESHOLD_MAX, as csbrk hands out at most 64 KB at once, which is also
+ * where it starts by default since blocks moved out of a heap that never
+ * shrinks only add to its footprint.
+ */
+#define MMAP_THRESHOLD_MAX (64 * 1024 - REGION_OVERHEAD)
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD MMAP_THRESHOLD_MAX
+#endif
+
+/*
+ * Free memory goes back to the OS in two ways. Once the free block at the top
+ * of the heap reaches TRIM_THRESHOLD bytes, the break is lowered until only
+ * TRIM_PAD bytes of it are left, and free blocks of at least
+ * DONTNEED_THRESHOLD bytes have the whole pages inside them released with
+ * madvise(MADV_DONTNEED). utrim does both right away, whatever the sizes, and
+ * also unmaps the slabs with no slots in use.
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128 * 1024)
+#endif
+#ifndef TRIM_PAD
+#define TRIM_PAD (16 * 1024)
+#endif
+#ifndef DONTNEED_THRESHOLD
+#define DONTNEED_THRESHOLD (256 * 1024)
+#endif
+
+/*
+ * Built with UMALLOC_THREADS, the allocator can be called from many threads.
+ * The heap is split into NUM_ARENAS arenas, each with its own slabs and free
+ * structures behind its own lock, and every thread is bound to one of them.
+ * Allocated heap blocks keep their arena in their next field, which is
+ * otherwise unused while they are allocated. A thread that frees memory of
+ * another arena pushes it on that arena's remote_frees stack without taking
+ * any lock, and the arena takes the whole stack back each time it is locked.
+ */
+#ifndef NUM_ARENAS
+#ifdef UMALLOC_THREADS
+#define NUM_ARENAS 8
+#else
+#define NUM_ARENAS 1
+#endif
+#endif
+
+/*
+ * Built with UMALLOC_CHECK, as everything linked with the heap checker is,
+ * each arena logs the heap blocks whose headers it rewrites or that go on or
+ * off a quick list in dirty_blocks, and the slabs that hand out or take back
+ * a slot in dirty_slabs, so the checker can look at just what an operation
+ * changed. Each log holds DIRTY_LOG_SIZE entries; once more were changed than
+ * that, its count stays at DIRTY_LOG_SIZE + 1 until the log is emptied, and
+ * the checker has to look at the whole heap instead. Only the checker empties
+ * them.
+ */
+#define DIRTY_LOG_SIZE 32
+
+typedef struct arena_struct {
+    memory_block_t *free_bins[NUM_BINS];   // the heads of the size-class free lists
+    uint64_t bin_map[BIN_WORDS];           // a set bit for each non-empty bin
+    uint64_t bin_summary;                  // a set bit for each non-zero word of bin_map
+    memory_block_t *bin_rovers[NUM_BINS];  // where next fit resumes in each bin
+    memory_block_t *quick_lists[QUICK_LISTS]; // freed small blocks, linked through their first word
+    size_t quick_bytes;                    // the payload bytes on the quick lists
+    tree_node_t *tree_root;                // the size tree holding the large free blocks
+    slab_t *slab_partial[SLAB_CLASSES];    // the slabs of each class with free slots
+    slab_t *slab_empty;                    // slab pages with no slots in use
+    region_t *regions;                     // the regions of the heap, newest first
+    size_t grow_next;                      // the least the heap grows by next time
+    size_t miss_average;                   // the recent bytes the heap had to grow by
+#ifdef UMALLOC_CHECK
+    memory_block_t *dirty_blocks[DIRTY_LOG_SIZE]; // heap blocks changed since the heap was last checked
+    size_t dirty_count;                    // the blocks logged, DIRTY_LOG_SIZE + 1 once it overflowed
+    slab_t *dirty_slabs[DIRTY_LOG_SIZE];   // slabs changed since the heap was last checked
+    size_t dirty_slab_count;               // the slabs logged, DIRTY_LOG_SIZE + 1 once it overflowed
+#endif
+#ifdef UMALLOC_THREADS
+    pthread_mutex_t lock;
+    void *_Atomic remote_frees;            // payloads freed by other threads, linked through their first word
+#endif
+} arena_t;
+
+/*
+ * Each thread also keeps the blocks of up to TCACHE_MAX_SIZE bytes it frees in
+ * a cache with a bin per size class. Cache hits take no lock at all; the arena
+ * is only locked to refill an empty bin or flush a full one, TCACHE_BATCH
+ * blocks at a time.
+ */
+#define TCACHE_MAX_SIZE EXACT_BIN_LIMIT
+#define TCACHE_CLASSES (TCACHE_MAX_SIZE / ALIGNMENT)
+#define TCACHE_COUNT 32
+#define TCACHE_BATCH (TCACHE_COUNT / 2)
+
+typedef struct {
+    void *head;                    // cached payloads, linked through their first word
+    size_t count;
+} tcache_bin_t;
+
+/*
+ * umalloc_stats reports how the heap of every arena is used right now, and,
+ * in a build with UMALLOC_STATS, how often find, split, coalesce and extend
+ * ran and how many free blocks each find looked at. Without UMALLOC_STATS the
+ * counting compiles to nothing, counted is false and the counters stay zero.
+ * Bucket 0 of search_lengths counts the finds that looked at no blocks, and
+ * bucket i > 0 those that looked at 2^(i-1) up to 2^i - 1 blocks, with the
+ * last bucket taking every longer search.
+ */
+#define STATS_BUCKETS 12
+
+typedef struct {
+    bool counted;                  // whether the allocator was built with UMALLOC_STATS
+    size_t find_calls;
+    size_t split_calls;
+    size_t coalesce_calls;
+    size_t extend_calls;
+    size_t splits;                 // split calls that left a free block behind
+    size_t merges;                 // coalesce calls that merged with a neighbor
+    size_t search_lengths[STATS_BUCKETS]; // finds by how many free blocks they looked at
+    size_t free_blocks;            // free heap blocks in the bins and the size tree
+    size_t free_bytes;             // the payload bytes of those blocks
+    size_t largest_free;           // the payload size of the largest of them
+    size_t header_bytes;           // the bytes of block headers and region_t in the heap
+    size_t resident_bytes;         // the bytes of the pages umalloc owns that are in memory
+} umalloc_stats_t;
+
+/*
+ * heap_walk_t - where a walk over the heap blocks of every region of every
+ * arena is. heap_walk_start sets one up, and each heap_walk_next moves it on to
+ * the next block, allocated or free, leaving region at the region the block
+ * is in. Prologues and epilogues are skipped. Nothing may change the heap
+ * during a walk.
+ */
+typedef struct {
+    int arena;                     // the index of the next arena to walk
+    region_t *region;              // the region being walked, NULL before the first
+    memory_block_t *block;         // the block the walk is at
+} heap_walk_t;
+
 // Helper Functions. Their parameters may be edited if you change their 
 // signature in umalloc.c. Do not change their purpose.
 bool is_allocated(memory_block_t *block);
+bool is_prev_allocated(memory_block_t *block);
+bool is_mmapped(memory_block_t *block);
+void set_prev_allocated(memory_block_t *block, bool prev_alloc);
 void allocate(memory_block_t *block);
 void deallocate(memory_block_t *block);
 size_t get_size(memory_block_t *block);
 memory_block_t *get_next(memory_block_t *block);
+memory_block_t *get_prev(memory_block_t *block);
+memory_block_t *get_next_adjacent(memory_block_t *block);
 void put_block(memory_block_t *block, size_t size, bool alloc);
 void *get_payload(memory_block_t *block);
 memory_block_t *get_block(void *payload);
 
+int get_bin(size_t size);
+void add_free(memory_block_t *block);
+void remove_free(memory_block_t *block);
+
+slab_t *get_slab(void *payload);
+bool slot_in_use(slab_t *slab, void *slot);
+region_t *get_region(void *addr);
+void heap_walk_start(heap_walk_t *walk);
+memory_block_t *heap_walk_next(heap_walk_t *walk);
+
 memory_block_t *find(size_t size);
 memory_block_t *extend(size_t size);
 memory_block_t *split(memory_block_t *block, size_t size);
 memory_block_t *coalesce(memory_block_t *block);
+void consolidate();
+bool is_quick(memory_block_t *block);
 
 
 // Portion that may not be edited
 int uinit();
 void *umalloc(size_t size);
-void ufree(void *ptr);
\ No newline at end of file
+void ufree(void *ptr);
+
+// Extensions to the allocator interface
+void *urealloc(void *ptr, size_t size);
+void *ucalloc(size_t nmemb, size_t size);
+void *umemalign(size_t alignment, size_t size);
+int uposix_memalign(void **memptr, size_t alignment, size_t size);
+void umalloc_set_mmap_threshold(size_t threshold);
+int utrim(size_t pad);
+void ufree_sized(void *ptr, size_t size);
+size_t umalloc_batch(size_t size, size_t n, void **out);
+void ufree_batch(void **ptrs, size_t n);
+void umalloc_stats(umalloc_stats_t *stats);
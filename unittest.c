@@ -21,7 +21,10 @@ static char printbuf[MAX_LINE_LENGTH];
 static char linebuf[MAX_LINE_LENGTH];
 static int size_offset;
 static bool check;
-extern memory_block_t *free_head;
+static void *heap_backup;
+static size_t heap_backup_size;
+static arena_t arena_backup;
+extern arena_t arenas[NUM_ARENAS];
 
 /* A struct for keeping track of test blocks. */
 typedef struct block_record {
@@ -31,15 +34,15 @@ typedef struct block_record {
 
 /* Function interfaces */
 static FILE *read_args(int argc, char **argv);
-static void list_add(record_t **record_table, uint32_t id);
-static void list_remove(record_t **record_table, uint32_t id);
-static memory_block_t *initialize_list(void *heap, record_t **record_table, FILE *infile);
-static void backup_list(record_t **dest, record_t **source, size_t len);
-static void run_tests(record_t **record_table, record_t **backup, size_t len, FILE *infile);
+static size_t initialize_list(void *heap, record_t **record_table, FILE *infile);
+static void backup_heap(void *heap, size_t len);
+static void restore_heap(void *heap);
+static void run_tests(record_t **record_table, void *heap, FILE *infile);
 
 static void print_block(memory_block_t *block);
 // static void print_records(record_t **record_table, size_t len);
-static void print_list(memory_block_t *free_list);
+static void print_tree(tree_node_t *node);
+static void print_bins();
 
 static void run_heap_check();
 static void test_find(size_t size);
@@ -68,24 +71,19 @@ int main(int argc, char **argv) {
     sscanf(linebuf, "%ld %ld", &heap_size, &num_blocks);
 
     record_t **record_table = (record_t **)calloc(num_blocks, sizeof(record_t *));
-    record_t **record_table_copy = (record_t **)calloc(num_blocks, sizeof(record_t *));
-    heap = csbrk(heap_size);
-    free_head = initialize_list(heap, record_table, infile);
-
-    for (int i = 0; i < num_blocks; i++) {
-        record_table_copy[i] = (record_t *)malloc(sizeof(record_t));
-        record_table_copy[i]->id = i+1;
-        record_table_copy[i]->addr = (memory_block_t *)malloc(sizeof(memory_block_t));
-    }
-    backup_list(record_table_copy, record_table, num_blocks);
+    /* Leave room for the epilogue that ends the heap, and start the first
+       block where its payload is aligned. */
+    heap = (char *)csbrk(heap_size + ALIGNMENT) + ALIGNMENT - HEADER_SIZE;
+    size_t total_size = initialize_list(heap, record_table, infile);
+    backup_heap(heap, total_size + HEADER_SIZE);
     
     sprintf(printbuf, "Initial free list state:");
     logging(LOG_INFO, printbuf);
-    print_list(free_head);
+    print_bins();
 
     run_heap_check();
 
-    run_tests(record_table, record_table_copy, num_blocks, infile);
+    run_tests(record_table, heap, infile);
     return EXIT_SUCCESS;
 }
 
@@ -103,7 +101,7 @@ static FILE *read_args(int argc, char **argv) {
                 }
                 break;
             case 's':
-                size_offset = sizeof(memory_block_t);
+                size_offset = HEADER_SIZE;
                 break;
             case 'c':
                 check = true;
@@ -122,28 +120,7 @@ static FILE *read_args(int argc, char **argv) {
     return infile;
 }
 
-static void list_add(record_t **record_table, uint32_t id) {
-    memory_block_t *block = NULL;
-    for (int i = 1; i < id; i++) {
-        if (!is_allocated(record_table[i-1]->addr)) {
-            block = record_table[i-1]->addr;
-        }
-    }
-    if (block) block->next = record_table[id-1]->addr;
-}
-
-static void list_remove(record_t **record_table, uint32_t id) {
-    memory_block_t *block = NULL;
-    for (int i = 1; i < id; i++) {
-        if (!is_allocated(record_table[i-1]->addr)) {
-            block = record_table[i-1]->addr;
-        }
-    }
-    if (block) block->next = record_table[id-1]->addr->next;
-}
-
-static memory_block_t *initialize_list(void *heap, record_t **record_table, FILE* infile) {
-    memory_block_t *free_list = NULL;
+static size_t initialize_list(void *heap, record_t **record_table, FILE* infile) {
     char op;
     uint32_t id;
     size_t size;
@@ -170,7 +147,7 @@ static memory_block_t *initialize_list(void *heap, record_t **record_table, FILE
         if (id > id_counter) {
             id_counter++;
             block = (memory_block_t *)(heap + total_size);
-            total_size += size + sizeof(memory_block_t);
+            total_size += size + HEADER_SIZE;
             /* ids are 1-indexed. */
             record_table[id-1] = (record_t *)malloc(sizeof(record_t));
             record_table[id-1]->id = id;
@@ -182,11 +159,9 @@ static memory_block_t *initialize_list(void *heap, record_t **record_table, FILE
         
         switch (op) {
             case ALLOC:
-                list_remove(record_table, id);
                 put_block(block, size + size_offset, true);
                 break;
             case FREE:
-                list_add(record_table, id);
                 put_block(block, size + size_offset, false);
                 break;
             default:
@@ -199,21 +174,37 @@ static memory_block_t *initialize_list(void *heap, record_t **record_table, FILE
         }
     }
 
-    free_list = record_table[0]->addr;
-    for (int i = 0; is_allocated(free_list); i++) {
-        free_list = record_table[0]->addr;
+    /* End the heap with an epilogue, then bin the free blocks. */
+    memory_block_t *epilogue = (memory_block_t *)(heap + total_size);
+    put_block(epilogue, 0, true);
+    bool prev_alloc = true;
+    for (int i = 0; i < id_counter; i++) {
+        set_prev_allocated(record_table[i]->addr, prev_alloc);
+        prev_alloc = is_allocated(record_table[i]->addr);
+    }
+    set_prev_allocated(epilogue, prev_alloc);
+    for (int i = 0; i < id_counter; i++) {
+        if (!is_allocated(record_table[i]->addr)) {
+            add_free(record_table[i]->addr);
+        }
     }
 
-    return free_list;
+    return total_size;
 }
 
-static void backup_list(record_t **dest, record_t **source, size_t len) {
-    for (int i = 0; i < len; i++) {
-        memcpy(dest[i]->addr, source[i]->addr, sizeof(memory_block_t));
-    }
+static void backup_heap(void *heap, size_t len) {
+    heap_backup = malloc(len);
+    heap_backup_size = len;
+    memcpy(heap_backup, heap, len);
+    arena_backup = arenas[0];
+}
+
+static void restore_heap(void *heap) {
+    memcpy(heap, heap_backup, heap_backup_size);
+    arenas[0] = arena_backup;
 }
 
-static void run_tests(record_t **record_table, record_t **backup, size_t len, FILE *infile) {
+static void run_tests(record_t **record_table, void *heap, FILE *infile) {
     char op;
     uint32_t id;
     size_t size;
@@ -254,7 +245,7 @@ static void run_tests(record_t **record_table, record_t **backup, size_t len, FI
         }
 
         run_heap_check();
-        backup_list(record_table, backup, len);
+        restore_heap(heap);
 
         if (fgets(linebuf, sizeof(linebuf), infile) == NULL) {
             logging(LOG_FATAL, "Could not read from input file.\n");
@@ -264,8 +255,8 @@ static void run_tests(record_t **record_table, record_t **backup, size_t len, FI
 }
 
 static void print_block(memory_block_t *block) {
-    sprintf(printbuf, "node at %p has size %ld, allocated status of %d, and next of %p", 
-        block, get_size(block), is_allocated(block), get_next(block));
+    sprintf(printbuf, "node at %p has size %ld, allocated status of %d, next of %p, and prev of %p", 
+        block, get_size(block), is_allocated(block), get_next(block), get_prev(block));
     logging(LOG_INFO, printbuf);
 }
 
@@ -277,11 +268,23 @@ static void print_block(memory_block_t *block) {
 //     }
 // }
 
-static void print_list(memory_block_t *head) {
-    while(head) {
-        print_block(head);
-        head = head->next;
+static void print_tree(tree_node_t *node) {
+    if (node) {
+        print_tree(node->left);
+        for (memory_block_t *head = &node->block; head; head = head->next) {
+            print_block(head);
+        }
+        print_tree(node->right);
+    }
+}
+
+static void print_bins() {
+    for (int bin = 0; bin < NUM_BINS; bin++) {
+        for (memory_block_t *head = arenas[0].free_bins[bin]; head; head = head->next) {
+            print_block(head);
+        }
     }
+    print_tree(arenas[0].tree_root);
     sprintf(printbuf, "End of free list.\n");
     logging(LOG_INFO, printbuf);
 }
@@ -345,6 +348,7 @@ static void test_split(record_t **record_table, uint32_t id, size_t size) {
     memory_block_t *block = record_table[id-1]->addr;
     size_t original_size = get_size(block);
     memory_block_t *original_next = block->next;
+    bool was_allocated = is_allocated(block);
 
     sprintf(printbuf, "Testing split on a block with an initial size of %ld:", get_size(block));
     logging(LOG_INFO, printbuf);
@@ -357,8 +361,8 @@ static void test_split(record_t **record_table, uint32_t id, size_t size) {
         sprintf(printbuf, "Split returned NULL.\n");
         logging(LOG_WARNING, printbuf);
     }
-    else if (original_size <= size+2*sizeof(memory_block_t)-size_offset) {
-        if (get_size(split_block) == original_size && split_block->next == original_next) {
+    else if (original_size <= size+HEADER_SIZE+ALIGNMENT-size_offset) {
+        if (get_size(split_block) == original_size && (split_block->next == original_next || !was_allocated)) {
             sprintf(printbuf, "Block was not split.\n");
             logging(LOG_INFO, printbuf);
         }
@@ -378,9 +382,9 @@ static void test_split(record_t **record_table, uint32_t id, size_t size) {
             sprintf(printbuf, "Block was split.");
             logging(LOG_INFO, printbuf);
             size_t alloc_size = get_size(split_block);
-            split_block = (memory_block_t *)((char *)split_block + sizeof(memory_block_t) - size_offset + alloc_size);
+            split_block = (memory_block_t *)((char *)split_block + HEADER_SIZE - size_offset + alloc_size);
             size_t new_size = get_size(split_block);
-            if (alloc_size >= ALIGN(size) && new_size + alloc_size + sizeof(memory_block_t) - size_offset == original_size) {
+            if (alloc_size >= BLOCK_ALIGN(size) && new_size + alloc_size + HEADER_SIZE - size_offset == original_size) {
                 sprintf(printbuf, "New sizes: %ld free, %ld allocated.\n", new_size, alloc_size);
                 logging(LOG_INFO, printbuf);
             }
@@ -395,7 +399,7 @@ static void test_split(record_t **record_table, uint32_t id, size_t size) {
             size_t alloc_size = get_size(split_block);
             split_block = (memory_block_t *)((char *)(split_block) - original_size + alloc_size);
             size_t new_size = get_size(split_block);
-            if (alloc_size >= ALIGN(size) && new_size + alloc_size + sizeof(memory_block_t) - size_offset == original_size) {
+            if (alloc_size >= BLOCK_ALIGN(size) && new_size + alloc_size + HEADER_SIZE - size_offset == original_size) {
                 sprintf(printbuf, "New sizes: %ld free, %ld allocated.", new_size, alloc_size);
                 logging(LOG_INFO, printbuf);
             }
@@ -421,15 +425,20 @@ static void test_coalesce(record_t **record_table, uint32_t id) {
 
     size_t target_size = original_size;
     if (can_coalesce_left) {
-        target_size += get_size(prev) + sizeof(memory_block_t) - size_offset;
+        target_size += get_size(prev) + HEADER_SIZE - size_offset;
     }
     if (can_coalesce_right) {
-        target_size += get_size(next) + sizeof(memory_block_t) - size_offset;
+        target_size += get_size(next) + HEADER_SIZE - size_offset;
     }
 
     sprintf(printbuf, "Testing coalesce on a block with an initial size of %ld:", get_size(block));
     logging(LOG_INFO, printbuf);
 
+    /* Coalesce expects a block that is not binned yet, like ufree does. */
+    if (!is_allocated(block)) {
+        remove_free(block);
+        original_next = NULL;
+    }
     memory_block_t *coalesced_block = coalesce(block);
     if (!coalesced_block) {
         sprintf(printbuf, "Coalesce returned NULL.\n");